@@ -11,9 +11,11 @@
     these to the two ESP devices.
   - Start the 'Serial Monitor' in both instances and set baud rate to 9600
   - Type 'startpair' into the edit box of the SensorServer. Hold the pairing button on the SensorClientDigitalInput device and reset the device
+    Several clients can be paired within one pairing window
   - After server and client are paired, you can change the sleep time of the client in the server
     by typing 'settimeout <seconds>' into the serial terminal. 
     This will than be send next time when sensor is up.
+  - Type 'listclients' to show the clients known by the server. The list is stored in LittleFS.
   
   - You can use multiple clients which can be connected to one server
 
@@ -27,8 +29,10 @@
 */
 
 #include "SimpleEspNowConnection.h"
+#include "SimpleEspNowLittleFSStorage.h"
 
 static SimpleEspNowConnection simpleEspConnection(SimpleEspNowRole::SERVER);
+static SimpleEspNowLittleFSStorage peerStorage; // known clients survive a restart of the server
 String inputString, clientAddress;
 String newTimeout = "";
 
@@ -45,8 +49,13 @@ void OnMessage(uint8_t* ad, const uint8_t* message, size_t len)
 void OnPaired(uint8_t *ga, String ad)
 {
   Serial.println("EspNowConnection : Client '"+ad+"' paired! ");
+}
+
+void OnPairingFinished()
+{
+  SimpleEspNowPairingStatistics_t stats = simpleEspConnection.getPairingStatistics();
 
-  simpleEspConnection.endPairing();  
+  Serial.printf("Pairing finished, %d client(s) paired\n", stats.pairedClients);
 }
 
 void OnConnected(uint8_t *ga, String ad)
@@ -65,9 +74,12 @@ void setup()
    // clientAddress = "ECFABC0CE7A2"; // Test if you know the client
 
   simpleEspConnection.begin();
+  if(!simpleEspConnection.setPeerStorage(&peerStorage))
+    Serial.println("Peer storage not available, known clients are lost on restart");
 //  simpleEspConnection.setPairingBlinkPort(2);
   simpleEspConnection.onMessage(&OnMessage);  
   simpleEspConnection.onPaired(&OnPaired);  
+  simpleEspConnection.onPairingFinished(&OnPairingFinished);  
   simpleEspConnection.onSendError(&OnSendError);  
   simpleEspConnection.onConnected(&OnConnected);  
 }
@@ -93,6 +105,16 @@ void loop()
         Serial.println("Will set new timeout of client next time when the device goes up...");
         newTimeout = atoi(inputString.substring(11).c_str());
       }          
+      else if(inputString == "listclients")
+      {
+        for(int i = 0; i < MaxPeerCount; i++)
+        {
+          SimpleEspNowPeer_t *peer = simpleEspConnection.getPeerBySlot(i);
+          
+          if(peer != NULL)
+            Serial.printf("%s last seen %lu ms ago, %u frames received\n", simpleEspConnection.macToStr(peer->mac).c_str(), millis() - peer->lastSeen, peer->rxCount);
+        }
+      }
             
       inputString = "";
     }
@@ -26,15 +26,25 @@
 */
 
 #include "SimpleEspNowConnection.h"
+#include "SimpleEspNowCodec.h"
 
 SimpleEspNowConnection simpleEspConnection(SimpleEspNowRole::SERVER);
 
 typedef struct struct_message {
-  char type;
   char a[32];
   int b;
   float c;
   bool e;
+
+  static const uint8_t SchemaVersion = 1;
+
+  void schema(SimpleEspNowCodec& codec) // used for encoding and decoding
+  {
+    codec.field(a, sizeof(a));
+    codec.field(b);
+    codec.field(c, 10000); // fixed point with 4 decimals
+    codec.field(e);
+  }
 } struct_message;
 
 
@@ -61,13 +71,15 @@ bool sendStructMessage()
 {
   struct_message myData;
   
-  myData.type = '#'; // just to mark first byte. It's on you how to distinguish between struct and text message
   sprintf (myData.a, "Greetings from %s", simpleEspConnection.myAddress.c_str());
   myData.b = random(1,20);
   myData.c = (float)random(1,100000)/(float)10000;
   myData.e = false;
     
-  return(simpleEspConnection.sendMessage((uint8_t *)&myData, sizeof(myData), clientAddress));
+  uint8_t buffer[EspNowFragmentSize];
+  size_t len = SimpleEspNowCodec::encode(myData, buffer, sizeof(buffer)); // usually much smaller than sizeof(myData)
+    
+  return(len > 0 && simpleEspConnection.sendMessage(buffer, len, clientAddress));
 }
 
 void OnSendError(uint8_t* ad)
@@ -77,11 +89,10 @@ void OnSendError(uint8_t* ad)
 
 void OnMessage(uint8_t* ad, const uint8_t* message, size_t len)
 {
-  if((char)message[0] == '#') // however you distinguish....
+  struct_message myData;
+
+  if(SimpleEspNowCodec::decode(myData, message, len)) // text messages do not match the schema
   {
-    struct_message myData;
-    
-    memcpy(&myData, message, len);
     Serial.printf("Structure:\n");    
     Serial.printf("a:%s\n", myData.a);    
     Serial.printf("b:%d\n", myData.b);    
@@ -95,9 +106,15 @@ void OnMessage(uint8_t* ad, const uint8_t* message, size_t len)
 void OnPaired(uint8_t *ga, String ad)
 {
   Serial.println("EspNowConnection : Client '"+ad+"' paired! ");
-  simpleEspConnection.endPairing();
   
-  clientAddress = ad;
+  clientAddress = ad; // pairing stays open, more clients can be paired within the same pairing window
+}
+
+void OnPairingFinished()
+{
+  SimpleEspNowPairingStatistics_t stats = simpleEspConnection.getPairingStatistics();
+  
+  Serial.printf("Pairing finished, %d client(s) paired with %d beacons\n", stats.pairedClients, stats.beaconsSent);
 }
 
 void OnConnected(uint8_t *ga, String ad)
@@ -117,6 +134,7 @@ void setup()
 //   simpleEspConnection.setPairingBlinkPort(2);
   simpleEspConnection.onMessage(&OnMessage);  
   simpleEspConnection.onPaired(&OnPaired);  
+  simpleEspConnection.onPairingFinished(&OnPairingFinished);  
   simpleEspConnection.onSendError(&OnSendError);
   simpleEspConnection.onConnected(&OnConnected);  
 
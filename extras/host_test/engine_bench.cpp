@@ -0,0 +1,139 @@
+// Throughput of sending from loop() against the transmit engine when the
+// sketch loop is busy. The radio needs 1 ms per frame, the sketch blocks for
+// a configurable time between two calls of loop().
+//
+// Afterwards the engine is switched off and on again while messages are
+// queued: nothing may be sent between setTransmitEngine(false) and the next
+// loop(), and the queue must not stall after the engine is enabled again.
+//
+//   engine_bench [ms the sketch blocks] [messages]
+
+#include "../../src/SimpleEspNowConnection.cpp"
+#include "mock.h"
+
+#include <chrono>
+#include <thread>
+
+#define FrameTime 1000		// us the radio needs for one frame
+#define MessageSize 1000
+
+using namespace std::chrono;
+
+static uint8_t peer[6] = {1, 1, 1, 1, 1, 1};
+static std::atomic<int> completed{0};
+static std::atomic<bool> stop{false};
+
+// reports every frame after FrameTime like the WiFi task
+static void radio()
+{
+	size_t seen = 0;
+
+	while(!stop)
+	{
+		if(sentCount.load() > seen)
+		{
+			seen++;
+			std::this_thread::sleep_for(microseconds(FrameTime));
+			sendCb(peer, ESP_NOW_SEND_SUCCESS);
+		}
+		else
+			std::this_thread::yield();
+	}
+}
+
+static double run(SimpleEspNowConnection &c, bool engine, int workMs, int messages)
+{
+	uint8_t message[MessageSize];
+	int queued = 0;
+
+	memset(message, 0, sizeof(message));
+	completed = 0;
+	c.setTransmitEngine(engine);
+
+	auto t0 = steady_clock::now();
+
+	while(completed < messages)
+	{
+		while(queued < messages && c.sendMessage(message, sizeof(message), peer))
+			queued++;
+
+		c.loop();
+		std::this_thread::sleep_for(milliseconds(workMs));	// the sketch does other work
+	}
+
+	double ms = duration_cast<microseconds>(steady_clock::now()-t0).count() / 1000.0;
+
+	c.setTransmitEngine(false);
+
+	return messages * MessageSize / ms;
+}
+
+// switches the engine off and on while the queue is not empty, one fragment per message
+static bool toggle(SimpleEspNowConnection &c, int rounds)
+{
+	uint8_t message[100];
+	bool ok = true;
+
+	memset(message, 0, sizeof(message));
+	completed = 0;
+	mockSendDelay = 2 * FrameTime;	// the task is most likely inside esp_now_send()
+
+	for(int r = 0; r<rounds && ok; r++)
+	{
+		ok &= c.sendMessage(message, sizeof(message), peer) != 0;
+		c.setTransmitEngine(true);
+		std::this_thread::sleep_for(microseconds(rand() % (3 * FrameTime)));
+		c.setTransmitEngine(false);
+
+		// the task has ended, nothing is sent until loop() or the engine runs again
+		size_t sent = sentCount.load();
+
+		std::this_thread::sleep_for(microseconds(3 * FrameTime));
+		ok &= sentCount.load() == sent;
+
+		// enabled again right away, the message has to go out without loop()
+		c.setTransmitEngine(true);
+		c.setTransmitEngine(false);
+		c.setTransmitEngine(true);
+
+		for(int w = 0; w<100 && completed <= r; w++)
+			std::this_thread::sleep_for(milliseconds(1));
+
+		ok &= completed == r+1;
+	}
+
+	c.setTransmitEngine(false);
+	mockSendDelay = 0;
+
+	return ok && c.isSendBufferEmpty();
+}
+
+int main(int argc, char **argv)
+{
+	int workMs = argc > 1 ? atoi(argv[1]) : 10;
+	int messages = argc > 2 ? atoi(argv[2]) : 40;
+
+	SimpleEspNowConnection c(SimpleEspNowRole::SERVER);
+
+	simpleEspNowConnection = &c;
+	c.begin();
+	c.onMessageComplete([](uint8_t*, SimpleEspNowMessageStatus_t) { completed++; });
+
+	std::thread radioTask(radio);
+
+	double loopRate = run(c, false, workMs, messages);
+	double engineRate = run(c, true, workMs, messages);
+
+	printf("%d messages of %d bytes, %d us per frame, sketch blocks %d ms\n", messages, MessageSize, FrameTime, workMs);
+	printf("loop()   %7.1f kB/s\n", loopRate);
+	printf("engine   %7.1f kB/s\n", engineRate);
+
+	bool toggled = toggle(c, 200);
+
+	printf("engine switched off and on: %s\n", toggled ? "ok" : "FAILED");
+
+	stop = true;
+	radioTask.join();
+
+	return toggled && engineRate > loopRate ? 0 : 1;
+}
@@ -0,0 +1,159 @@
+// Minimal Arduino core for building SimpleEspNowConnection on a host PC.
+// Critical sections are spinlocks and FreeRTOS tasks are std::threads, so
+// the ESP32 build runs its callbacks, loop() and the transmit engine truly
+// in parallel.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <functional>
+#include <string>
+
+typedef bool boolean;
+#define OUTPUT 1
+#define INPUT 0
+#define INPUT_PULLUP 2
+#define HIGH 1
+#define LOW 0
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long);
+void yield();
+void pinMode(int, int);
+void digitalWrite(int, int);
+int digitalRead(int);
+void noInterrupts();
+void interrupts();
+long random(long, long);
+
+// millis() follows the real clock plus mockMillisOffset. With mockVirtualClock
+// set it returns mockMillisOffset only, simulations advance it themselves.
+extern unsigned long mockMillisOffset;
+extern bool mockVirtualClock;
+
+class String
+{
+  public:
+	std::string s;
+	String() {}
+	String(const char* c) : s(c ? c : "") {}
+	String(int v) : s(std::to_string(v)) {}
+	String(unsigned v) : s(std::to_string(v)) {}
+	String(long v) : s(std::to_string(v)) {}
+	String(unsigned long v) : s(std::to_string(v)) {}
+	size_t length() const { return s.size(); }
+	const char* c_str() const { return s.c_str(); }
+	String operator+(const String& o) const { String r; r.s = s + o.s; return r; }
+	friend String operator+(const char* a, const String& b) { String r; r.s = std::string(a) + b.s; return r; }
+	bool operator==(const char* o) const { return s == o; }
+	String& operator+=(char c) { s += c; return *this; }
+	String substring(int a) const { return String(s.substr(a).c_str()); }
+};
+
+class Print
+{
+  public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t) { return 1; }
+	virtual size_t write(const uint8_t*, size_t n) { return n; }
+	size_t print(const char*) { return 0; }
+	size_t print(const String&) { return 0; }
+	size_t println(const char* = "") { return 0; }
+	size_t println(const String&) { return 0; }
+	size_t printf(const char*, ...) { return 0; }
+};
+
+class Stream : public Print {};
+
+class HardwareSerial : public Stream
+{
+  public:
+	void begin(int) {}
+	int available() { return 0; }
+	int read() { return -1; }
+};
+
+extern HardwareSerial Serial;
+
+#if defined(ESP32)
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+struct portMUX_TYPE { std::atomic_flag f = ATOMIC_FLAG_INIT; };
+#define portMUX_INITIALIZER_UNLOCKED {}
+#define portENTER_CRITICAL(m) do { while((m)->f.test_and_set(std::memory_order_acquire)) { std::this_thread::yield(); } } while(0)
+#define portEXIT_CRITICAL(m) (m)->f.clear(std::memory_order_release)
+
+typedef int BaseType_t;
+typedef unsigned TickType_t;
+typedef unsigned UBaseType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFFu
+#define pdMS_TO_TICKS(ms) (ms)
+
+struct MockTask
+{
+	std::mutex m;
+	std::condition_variable cv;
+	unsigned count = 0;
+	std::thread t;
+};
+
+typedef MockTask* TaskHandle_t;
+extern thread_local MockTask* mockCurrentTask;
+
+inline BaseType_t xTaskCreate(void (*fn)(void*), const char*, unsigned, void* arg, UBaseType_t, TaskHandle_t* h)
+{
+	MockTask* t = new MockTask();
+	
+	if(h)
+		*h = t;
+	
+	t->t = std::thread([fn, arg, t]{ mockCurrentTask = t; fn(arg); });
+	t->t.detach();
+	
+	return pdPASS;
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return mockCurrentTask; }
+inline void vTaskDelete(TaskHandle_t) {}
+inline void vTaskDelay(TickType_t ticks) { std::this_thread::sleep_for(std::chrono::milliseconds(ticks)); }
+
+inline void xTaskNotifyGive(TaskHandle_t t)
+{
+	{
+		std::lock_guard<std::mutex> l(t->m);
+		t->count++;
+	}
+	t->cv.notify_one();
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+	MockTask* t = mockCurrentTask;
+	std::unique_lock<std::mutex> l(t->m);
+	
+	if(ticks == portMAX_DELAY)
+		t->cv.wait(l, [t]{ return t->count > 0; });
+	else
+		t->cv.wait_for(l, std::chrono::milliseconds(ticks), [t]{ return t->count > 0; });
+	
+	uint32_t c = t->count;
+	
+	if(clear)
+		t->count = 0;
+	else if(c)
+		t->count--;
+	
+	return c;
+}
+#endif
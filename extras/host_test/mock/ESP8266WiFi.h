@@ -0,0 +1,16 @@
+#pragma once
+#include <Arduino.h>
+#define WIFI_STA 1
+
+extern uint8_t mockMacAddress[6];	// returned by WiFi.macAddress(), set before begin()
+
+class WiFiClass
+{
+  public:
+	void mode(int) {}
+	void persistent(bool) {}
+	uint8_t* macAddress(uint8_t* m) { memcpy(m, mockMacAddress, 6); return m; }
+	String macAddress() { return String(); }
+};
+
+extern WiFiClass WiFi;
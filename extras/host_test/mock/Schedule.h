@@ -0,0 +1,5 @@
+#pragma once
+#include <functional>
+#include <stdint.h>
+bool schedule_recurrent_function_us(const std::function<bool(void)>& fn, uint32_t repeat_us, const std::function<bool(void)>& alarm = nullptr);
+void run_scheduled_recurrent_functions();
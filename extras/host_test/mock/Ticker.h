@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+class Ticker { public:
+ typedef void (*callback_t)(void);
+ void attach(float, callback_t) {}
+ void attach_ms(uint32_t, callback_t) {}
+ void once(float, callback_t) {}
+ void once_ms(uint32_t, callback_t) {}
+ void detach() {}
+ bool active() { return false; }
+};
@@ -0,0 +1,10 @@
+#pragma once
+// An ESP-IDF 4.4 based core (arduino-esp32 2.x) unless MOCK_IDF_MAJOR and
+// MOCK_IDF_MINOR select another release, e.g. 5 and 5 for arduino-esp32 3.3.
+#ifndef MOCK_IDF_MAJOR
+#define MOCK_IDF_MAJOR 4
+#define MOCK_IDF_MINOR 4
+#endif
+
+#define ESP_IDF_VERSION_VAL(major, minor, patch) (((major) << 16) | ((minor) << 8) | (patch))
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(MOCK_IDF_MAJOR, MOCK_IDF_MINOR, 0)
@@ -0,0 +1,4 @@
+#pragma once
+#include <stdint.h>
+#define WIFI_IF_STA 0
+int esp_wifi_set_mac(int, const uint8_t*);
@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+#define ESP_NOW_ROLE_COMBO 3
+typedef void (*esp_now_recv_cb_t)(uint8_t*, uint8_t*, uint8_t);
+typedef void (*esp_now_send_cb_t)(uint8_t*, uint8_t);
+int esp_now_init();
+int esp_now_set_self_role(uint8_t);
+int esp_now_register_recv_cb(esp_now_recv_cb_t);
+int esp_now_register_send_cb(esp_now_send_cb_t);
+int esp_now_unregister_send_cb();
+int esp_now_add_peer(uint8_t*, uint8_t, uint8_t, uint8_t*, uint8_t);
+int esp_now_del_peer(uint8_t*);
+int esp_now_is_peer_exist(uint8_t*);
+int esp_now_send(uint8_t*, uint8_t*, int);
@@ -0,0 +1,105 @@
+// Radio and system stubs for the host tests. Every esp_now_send() is
+// recorded in sentFrames, tests deliver the frames and call the send
+// callback themselves.
+#include <Arduino.h>
+#include <WiFi.h>
+#include <Ticker.h>
+#include <Schedule.h>
+#include <LittleFS.h>
+#include <chrono>
+#include <vector>
+#include "mock.h"
+
+#ifdef ESP32
+#include <esp_now.h>
+#include <esp_wifi.h>
+#endif
+
+static auto t0 = std::chrono::steady_clock::now();
+unsigned long mockMillisOffset = 0;
+bool mockVirtualClock = false;
+
+unsigned long millis()
+{
+	if(mockVirtualClock)
+		return mockMillisOffset;
+	
+	return mockMillisOffset + std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-t0).count();
+}
+
+unsigned long micros()
+{
+	if(mockVirtualClock)
+		return mockMillisOffset * 1000;
+	
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-t0).count();
+}
+
+void delay(unsigned long) {}
+void yield() {}
+void pinMode(int, int) {}
+void digitalWrite(int, int) {}
+int digitalRead(int) { return 0; }
+void noInterrupts() {}
+void interrupts() {}
+long random(long a, long b) { return a + rand() % (b-a); }
+
+HardwareSerial Serial;
+WiFiClass WiFi;
+uint8_t mockMacAddress[6] = {0x02, 0, 0, 0, 0, 1};
+FS LittleFS;
+
+std::vector<SentFrame> sentFrames;
+std::mutex sentLock;
+std::atomic<size_t> sentCount{0};
+int mockSendResult = 0;
+std::atomic<int> mockSendDelay{0};
+
+#ifdef ESP32
+esp_now_recv_cb_t recvCb;
+esp_now_send_cb_t sendCb;
+thread_local MockTask* mockCurrentTask = nullptr;
+
+esp_err_t esp_now_init() { return 0; }
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t c) { recvCb = c; return 0; }
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t c) { sendCb = c; return 0; }
+esp_err_t esp_now_unregister_send_cb() { return 0; }
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t*) { return 0; }
+esp_err_t esp_now_del_peer(const uint8_t*) { return 0; }
+bool esp_now_is_peer_exist(const uint8_t*) { return false; }
+int esp_wifi_set_mac(int, const uint8_t*) { return 0; }
+
+esp_err_t esp_now_send(const uint8_t* m, const uint8_t* d, size_t l)
+{
+	if(mockSendResult != 0)
+		return mockSendResult;
+	
+	if(mockSendDelay > 0)
+		std::this_thread::sleep_for(std::chrono::microseconds(mockSendDelay.load()));
+	
+	std::lock_guard<std::mutex> lock(sentLock);
+	sentFrames.push_back({std::vector<uint8_t>(m, m+6), std::vector<uint8_t>(d, d+l)});
+	sentCount++;
+	
+	return 0;
+}
+#endif
+
+static std::vector<std::function<bool(void)>> recurrent;
+
+bool schedule_recurrent_function_us(const std::function<bool(void)>& fn, uint32_t, const std::function<bool(void)>&)
+{
+	recurrent.push_back(fn);
+	return true;
+}
+
+void run_scheduled_recurrent_functions()
+{
+	for(size_t i = 0; i<recurrent.size();)
+	{
+		if(recurrent[i]())
+			i++;
+		else
+			recurrent.erase(recurrent.begin()+i);
+	}
+}
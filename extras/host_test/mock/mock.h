@@ -0,0 +1,24 @@
+// Access to the recorded frames and callbacks of the radio stubs.
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#ifdef ESP32
+#include <esp_now.h>
+extern esp_now_recv_cb_t recvCb;
+extern esp_now_send_cb_t sendCb;
+#endif
+
+typedef struct SentFrame
+{
+	std::vector<uint8_t> mac;
+	std::vector<uint8_t> data;
+} SentFrame;
+
+extern std::vector<SentFrame> sentFrames;	// guarded by sentLock when tasks send
+extern std::mutex sentLock;
+extern std::atomic<size_t> sentCount;
+extern int mockSendResult;					// returned by esp_now_send() if not 0
+extern std::atomic<int> mockSendDelay;		// us esp_now_send() takes
@@ -0,0 +1,3 @@
+#pragma once
+#define RTC_CNTL_BROWN_OUT_REG 0
+#define WRITE_PERI_REG(a,b)
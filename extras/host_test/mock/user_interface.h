@@ -0,0 +1,4 @@
+#pragma once
+#include <stdint.h>
+#define STATION_IF 0
+bool wifi_set_macaddr(uint8_t, uint8_t*);
@@ -0,0 +1,178 @@
+// Firmware transfer from a server to a client over a link which loses a
+// share of the frames in both directions. Each side sends one frame per ms.
+// The image has to arrive complete and both sides have to report success,
+// also when the result of the client is the frame that gets lost. Losses
+// must slow the transfer down, not stall it: it has to keep a tenth of the
+// rate without loss.
+//
+//   ota_loss [image size] [loss in % ...]
+
+#include "../../src/SimpleEspNowConnection.cpp"
+#include "mock.h"
+
+#define MaxSteps 600000		// ms before a transfer counts as stuck
+
+class MemoryTarget : public SimpleEspNowOtaTarget
+{
+public:
+	std::vector<uint8_t> image;
+	uint32_t size = 0;
+	int begins = 0;
+	bool inOrder = true;
+
+	bool begin(uint32_t s, const uint8_t*) { size = s; image.clear(); begins++; return true; }
+	bool write(uint32_t offset, const uint8_t *data, size_t len) { inOrder &= offset == image.size(); image.insert(image.end(), data, data+len); return true; }
+	bool end() { return inOrder && image.size() == size; }
+	void abort() { image.clear(); }
+};
+
+typedef struct Result
+{
+	bool ok;
+	unsigned long ms;
+	long sent;		// frames of both sides
+} Result;
+
+static uint8_t serverMac[6] = {2, 0, 0, 0, 0, 1};
+static uint8_t clientMac[6] = {2, 0, 0, 0, 0, 2};
+
+// runs fn as the given side and returns the frames it handed to the radio
+static std::vector<SentFrame> call(SimpleEspNowConnection &c, std::function<void(void)> fn)
+{
+	std::vector<SentFrame> out;
+
+	simpleEspNowConnection = &c;
+	fn();
+	out.swap(sentFrames);
+
+	return out;
+}
+
+static bool isResult(const SentFrame &f)
+{
+	return f.data.size() == EspNowHeaderSize + 6 && f.data[EspNowHeaderSize] == OtaResult;
+}
+
+static Result transfer(const std::vector<uint8_t> &image, int lossPct, bool loseResult)
+{
+	Result r = {false, 0, 0};
+	uint8_t md5[16] = {1};
+	int serverDone = 0, clientDone = 0;
+	bool serverOk = false, clientOk = false;
+
+	mockMillisOffset = 1000;
+
+	SimpleEspNowConnection server(SimpleEspNowRole::SERVER);
+	SimpleEspNowConnection client(SimpleEspNowRole::CLIENT);
+	MemoryTarget target;
+
+	call(server, [&]{ server.begin(); server.onOtaFinished([&](uint8_t*, bool s) { serverDone++; serverOk = s; }); });
+	call(client, [&]{ client.begin(); client.setOtaTarget(&target); client.onOtaFinished([&](uint8_t*, bool s) { clientDone++; clientOk = s; }); });
+
+	// frames in flight, delivered one tick later
+	std::vector<SentFrame> toClient, toServer;
+	bool lossy = false;
+
+	toServer = call(client, [&]{ client.setServerMac(serverMac); });
+
+	auto deliver = [&](SimpleEspNowConnection &from, SimpleEspNowConnection &to, const uint8_t *fromMac, std::vector<SentFrame> &frames, std::vector<SentFrame> &answers)
+	{
+		for(SentFrame &f : frames)
+		{
+			std::vector<SentFrame> back = call(from, [&]{ sendCb(f.mac.data(), ESP_NOW_SEND_SUCCESS); });
+
+			answers.insert(answers.end(), back.begin(), back.end());
+			r.sent++;
+
+			if(lossy && loseResult && isResult(f))
+			{
+				loseResult = false;
+				continue;
+			}
+
+			if(lossy && rand() % 100 < lossPct)
+				continue;
+
+			std::vector<SentFrame> reply = call(to, [&]{ recvCb(fromMac, f.data.data(), f.data.size()); });
+
+			answers.insert(answers.end(), reply.begin(), reply.end());
+		}
+
+		frames.clear();
+	};
+
+	unsigned long start = 0;
+
+	for(long step = 0; step<MaxSteps && (serverDone == 0 || clientDone == 0); step++)
+	{
+		// connected and in sync, the transfer starts
+		if(step == 100)
+		{
+			call(server, [&]{ server.startOta(clientMac, image.size(), md5, [&](uint32_t offset, uint8_t *buf, size_t len) { memcpy(buf, image.data()+offset, len); return len; }); });
+			lossy = true;
+			start = millis();
+		}
+
+		std::vector<SentFrame> out = call(server, [&]{ server.loop(); });
+
+		toClient.insert(toClient.end(), out.begin(), out.end());
+		out = call(client, [&]{ client.loop(); });
+		toServer.insert(toServer.end(), out.begin(), out.end());
+
+		std::vector<SentFrame> fromClient = toServer, fromServer = toClient;
+
+		toServer.clear();
+		toClient.clear();
+		deliver(server, client, serverMac, fromServer, toServer);
+		deliver(client, server, clientMac, fromClient, toClient);
+		mockMillisOffset++;
+	}
+
+	r.ms = millis() - start;
+	r.ok = serverDone == 1 && serverOk && clientDone == 1 && clientOk && target.begins == 1 && target.image == image;
+
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = argc > 1 ? atol(argv[1]) : 100000;
+	std::vector<int> losses;
+	double lossless = 0;
+	bool ok = true;
+
+	for(int i = 2; i<argc; i++)
+		losses.push_back(atoi(argv[i]));
+
+	if(losses.empty())
+		losses = {0, 10, 30};
+
+	std::vector<uint8_t> image(size);
+
+	srand(1);
+	mockVirtualClock = true;
+
+	for(size_t i = 0; i<size; i++)
+		image[i] = rand();
+
+	printf("%zu byte image, one frame per ms in each direction\n", size);
+	printf("%6s %12s %10s %8s\n", "loss", "result lost", "kB/s", "frames");
+
+	for(int loss : losses)
+	{
+		for(int loseResult = 0; loseResult<2; loseResult++)
+		{
+			Result r = transfer(image, loss, loseResult);
+			double rate = r.ms ? (double)size / r.ms : 0.0;
+
+			if(loss == 0 && !loseResult)
+				lossless = rate;
+
+			r.ok &= rate >= lossless / 10;
+			printf("%5d%% %12s %10.1f %8ld %s\n", loss, loseResult ? "yes" : "no", rate, r.sent, r.ok ? "ok" : "FAILED");
+			ok &= r.ok;
+		}
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,243 @@
+// Cost of publish() on the server as the number of subscribers and topics
+// grows, compared to one sendMessage() per subscriber. Frames are queued in
+// the timed part only, they are sent and delivered outside of it.
+//
+// Afterwards the server is restarted with its peer database on a storage and
+// has to learn the subscriptions of the clients again without a CONNECT.
+//
+//   publish_bench [rounds]
+
+#include "../../src/SimpleEspNowConnection.cpp"
+#include "mock.h"
+
+#include <algorithm>
+#include <chrono>
+
+#define MaxClients 48
+#define PayloadSize 200
+
+typedef struct Node
+{
+	SimpleEspNowConnection *conn;
+	uint8_t mac[6];
+	long received;
+} Node;
+
+class MemoryStorage : public SimpleEspNowPeerStorage
+{
+  public:
+	std::vector<uint8_t> data;
+
+	bool begin(size_t size) { if(data.size() != size) data.assign(size, 0); return true; }
+	bool read(size_t offset, uint8_t* d, size_t len) { memcpy(d, data.data()+offset, len); return true; }
+	bool write(size_t offset, const uint8_t* d, size_t len) { memcpy(data.data()+offset, d, len); return true; }
+};
+
+static Node nodes[1+MaxClients];
+static int nodeCount;
+
+static Node *findNode(const std::vector<uint8_t> &mac)
+{
+	for(int i = 0; i<nodeCount; i++)
+	{
+		if(memcmp(nodes[i].mac, mac.data(), 6) == 0)
+			return &nodes[i];
+	}
+
+	return NULL;
+}
+
+// runs loop() of all nodes and delivers the frames until nothing is left to send
+static void pump()
+{
+	for(int idle = 0; idle<3; )
+	{
+		bool sent = false;
+
+		for(int i = 0; i<nodeCount; i++)
+		{
+			std::vector<SentFrame> frames;
+
+			simpleEspNowConnection = nodes[i].conn;
+			nodes[i].conn->loop();
+			frames.swap(sentFrames);
+
+			for(auto &f : frames)
+			{
+				Node *dst = findNode(f.mac);
+
+				if(dst != NULL)
+				{
+					simpleEspNowConnection = dst->conn;
+					recvCb(nodes[i].mac, f.data.data(), f.data.size());
+				}
+
+				simpleEspNowConnection = nodes[i].conn;
+				sendCb(f.mac.data(), ESP_NOW_SEND_SUCCESS);
+				sent = true;
+			}
+		}
+
+		mockMillisOffset += 10;
+		idle = sent ? 0 : idle+1;
+	}
+}
+
+static void createNode(int i)
+{
+	uint8_t mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, (uint8_t)i};
+
+	memcpy(nodes[i].mac, mac, 6);
+	memcpy(mockMacAddress, mac, 6);
+	nodes[i].received = 0;
+	nodes[i].conn = new SimpleEspNowConnection(i == 0 ? SimpleEspNowRole::SERVER : SimpleEspNowRole::CLIENT);
+	simpleEspNowConnection = nodes[i].conn;
+	nodes[i].conn->begin();
+	sentFrames.clear();
+}
+
+static void setup(int clients, int topics, MemoryStorage *storage)
+{
+	nodeCount = clients + 1;
+
+	for(int i = 0; i<nodeCount; i++)
+		createNode(i);
+
+	if(storage != NULL)
+		nodes[0].conn->setPeerStorage(storage);
+
+	for(int i = 1; i<nodeCount; i++)
+	{
+		Node *n = &nodes[i];
+
+		n->conn->onMessage([n](uint8_t*, const uint8_t*, size_t) { n->received++; });
+		n->conn->onPublish([n](uint8_t*, uint16_t, const uint8_t*, size_t) { n->received++; });
+		simpleEspNowConnection = n->conn;
+		n->conn->setServerMac(nodes[0].mac);
+
+		for(int t = 0; t<topics; t++)
+			n->conn->subscribe(t);
+
+		pump();
+	}
+}
+
+static void teardown()
+{
+	for(int i = 0; i<nodeCount; i++)
+		delete nodes[i].conn;
+}
+
+static long received()
+{
+	long sum = 0;
+
+	for(int i = 1; i<nodeCount; i++)
+		sum += nodes[i].received;
+
+	return sum;
+}
+
+// median time in us to queue one message for all subscribers
+static double measure(int clients, int topics, int rounds, bool publish, bool *ok)
+{
+	uint8_t payload[PayloadSize];
+	std::vector<double> times;
+
+	memset(payload, 0x55, sizeof(payload));
+	setup(clients, topics, NULL);
+	simpleEspNowConnection = nodes[0].conn;
+
+	for(int r = 0; r<rounds; r++)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+
+		if(publish)
+			*ok &= nodes[0].conn->publish(topics-1, payload, sizeof(payload)) > 0;
+		else
+		{
+			for(int i = 1; i<nodeCount; i++)
+				*ok &= nodes[0].conn->sendMessage(payload, sizeof(payload), nodes[i].mac) != 0;
+		}
+
+		times.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now()-t0).count());
+		pump();
+		simpleEspNowConnection = nodes[0].conn;
+	}
+
+	*ok &= received() == (long)rounds * clients;
+	teardown();
+
+	std::sort(times.begin(), times.end());
+
+	return times[times.size()/2];
+}
+
+// the restarted server knows the clients from the storage, but not their topics
+static bool restart()
+{
+	MemoryStorage storage;
+	uint8_t payload[PayloadSize];
+	int clients = 4;
+
+	memset(payload, 0x55, sizeof(payload));
+	setup(clients, 2, &storage);
+	simpleEspNowConnection = nodes[0].conn;
+	nodes[0].conn->flushPeers();
+	delete nodes[0].conn;
+	createNode(0);
+	nodes[0].conn->setPeerStorage(&storage);
+
+	bool ok = nodes[0].conn->getSubscriberCount(1) == 0;
+
+	// any frame of a client makes the server ask for its subscriptions
+	for(int i = 1; i<nodeCount; i++)
+	{
+		simpleEspNowConnection = nodes[i].conn;
+		nodes[i].conn->sendMessage(payload, 4, nodes[0].mac);
+		pump();
+	}
+
+	simpleEspNowConnection = nodes[0].conn;
+	ok &= nodes[0].conn->getSubscriberCount(1) == clients;
+	ok &= nodes[0].conn->publish(1, payload, sizeof(payload)) > 0;
+	pump();
+
+	for(int i = 1; i<nodeCount; i++)
+		ok &= nodes[i].received == 1;
+
+	teardown();
+
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 200;
+	int clients[] = {1, 8, 24, 48};
+	int topics[] = {1, 4, MaxSubscriptions};
+	bool ok = true;
+
+	mockVirtualClock = true;
+	mockMillisOffset = 1000;
+
+	printf("queueing one %d byte message for all subscribers, median of %d rounds in us\n", PayloadSize, rounds);
+	printf("%11s %6s %9s %13s\n", "subscribers", "topics", "publish", "sendMessage");
+
+	for(int c : clients)
+	{
+		for(int t : topics)
+		{
+			double pub = measure(c, t, rounds, true, &ok);
+			double single = measure(c, t, rounds, false, &ok);
+
+			printf("%11d %6d %9.1f %13.1f\n", c, t, pub, single);
+		}
+	}
+
+	bool resubscribed = restart();
+
+	printf("subscriptions after server restart: %s\n", resubscribed ? "restored" : "lost");
+
+	return ok && resubscribed ? 0 : 1;
+}
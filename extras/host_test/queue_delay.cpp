@@ -0,0 +1,119 @@
+// Queueing delay of small messages to three clients while a bulk transfer
+// to a fourth client keeps the send buffer busy. The server sends one frame
+// per ms. The delays per peer come from getQueueStatistics().
+//
+// The same arrivals are replayed first in, first out, which is how the send
+// buffer was served before the per destination scheduling: a small message
+// waited for every fragment queued ahead of it.
+//
+//   queue_delay [ms] [ms between two small messages]
+
+#include "../../src/SimpleEspNowConnection.cpp"
+#include "mock.h"
+
+#define BulkSize 9000		// bytes of one bulk message
+#define SmallSize 20
+#define Clients 4			// the first one gets the bulk transfer
+
+typedef struct Arrival
+{
+	unsigned long time;
+	int client;
+	int fragments;
+} Arrival;
+
+static uint8_t macs[Clients][6] = {{2,0,0,0,0,1}, {2,0,0,0,0,2}, {2,0,0,0,0,3}, {2,0,0,0,0,4}};
+
+int main(int argc, char **argv)
+{
+	unsigned long duration = argc > 1 ? atol(argv[1]) : 2000;
+	unsigned long interval = argc > 2 ? atol(argv[2]) : 10;
+	std::vector<Arrival> arrivals;
+	uint8_t bulk[BulkSize], small[SmallSize];
+	int next = 1;
+
+	memset(bulk, 0xAA, sizeof(bulk));
+	memset(small, 0x55, sizeof(small));
+	mockVirtualClock = true;
+	mockMillisOffset = 1000;
+
+	SimpleEspNowConnection c(SimpleEspNowRole::SERVER);
+
+	simpleEspNowConnection = &c;
+	c.begin();
+
+	for(int i = 0; i<Clients; i++)
+		c.addPeer(macs[i]);
+
+	int bulkFragments = 0;
+	unsigned long start = millis();
+
+	for(unsigned long t = 0; t<duration; t++)
+	{
+		// the bulk client always has a message waiting
+		if(c.getQueueStatistics(macs[0]).queued == 0 && c.sendMessage(bulk, sizeof(bulk), macs[0]) != 0)
+		{
+			bulkFragments = c.getQueueStatistics(macs[0]).queued;
+			arrivals.push_back({t, 0, bulkFragments});
+		}
+
+		if(t % interval == 0 && c.sendMessage(small, sizeof(small), macs[next]) != 0)
+			arrivals.push_back({t, next, 1});
+
+		if(t % interval == 0)
+			next = next % (Clients-1) + 1;
+
+		c.loop();
+
+		if(!sentFrames.empty())
+		{
+			SentFrame f = sentFrames.back();
+
+			sentFrames.clear();
+			sendCb(f.mac.data(), ESP_NOW_SEND_SUCCESS);
+		}
+
+		mockMillisOffset++;
+	}
+
+	// the same arrivals, served in the order they were queued
+	double fifoSum[Clients] = {0};
+	unsigned long fifoMax[Clients] = {0}, fifoCount[Clients] = {0}, free = 0;
+
+	for(Arrival &a : arrivals)
+	{
+		for(int n = 0; n<a.fragments && free < duration; n++)
+		{
+			unsigned long sent = free > a.time ? free : a.time;
+			unsigned long delay = sent - a.time;
+
+			fifoSum[a.client] += delay;
+			fifoCount[a.client]++;
+
+			if(delay > fifoMax[a.client])
+				fifoMax[a.client] = delay;
+
+			free = sent + 1;
+		}
+	}
+
+	bool ok = true;
+
+	printf("bulk transfer to client 0, %d byte messages to clients 1-%d every %lu ms, %lu ms\n", SmallSize, Clients-1, interval, millis() - start);
+	printf("%6s %9s %12s %11s %12s %11s\n", "client", "fragments", "fair mean", "fair max", "fifo mean", "fifo max");
+
+	for(int i = 0; i<Clients; i++)
+	{
+		SimpleEspNowQueueStatistics_t s = c.getQueueStatistics(macs[i]);
+		double mean = s.sent ? (double)s.delaySum / s.sent : 0;
+
+		printf("%6d %9u %9.1f ms %8u ms %9.1f ms %8lu ms\n", i, s.sent, mean, s.delayMax,
+			fifoCount[i] ? fifoSum[i] / fifoCount[i] : 0.0, fifoMax[i]);
+
+		// the small messages must not wait for the bulk transfer
+		if(i > 0)
+			ok &= s.sent > 0 && s.delayMax < (unsigned)bulkFragments / 2;
+	}
+
+	return ok ? 0 : 1;
+}
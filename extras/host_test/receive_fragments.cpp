@@ -0,0 +1,172 @@
+// Reassembly and duplicate detection on the receiving side. Fragments are
+// injected into the receive callback as they arrive over the air: in order,
+// repeated, with a fragment missing and interleaved from two senders.
+//
+//   receive_fragments [random messages]
+
+#include "../../src/SimpleEspNowConnection.cpp"
+#include "mock.h"
+
+#define FragmentSize 200
+
+typedef struct Delivery
+{
+	uint8_t mac[6];
+	std::vector<uint8_t> data;
+} Delivery;
+
+static std::vector<Delivery> deliveries;
+static uint8_t peerA[6] = {2, 0, 0, 0, 0, 1};
+static uint8_t peerB[6] = {2, 0, 0, 0, 0, 2};
+
+static std::vector<uint8_t> makeMessage(long id, size_t len)
+{
+	std::vector<uint8_t> m(len);
+
+	for(size_t i = 0; i<len; i++)
+		m[i] = (uint8_t)(id*13 + i);
+
+	return m;
+}
+
+// fragment n (1 based) of message id as the sender puts it on the air
+static void receive(const uint8_t *mac, long id, const std::vector<uint8_t> &m, int n)
+{
+	int packages = (m.size() + FragmentSize - 1) / FragmentSize;
+	size_t pos = (n-1) * FragmentSize;
+	size_t len = m.size() - pos < FragmentSize ? m.size() - pos : FragmentSize;
+	std::vector<uint8_t> frame(EspNowHeaderSize + len);
+
+	frame[0] = 1;	// DATA
+	frame[1] = n;
+	frame[2] = packages;
+	memcpy(&frame[3], &id, 4);
+	memcpy(&frame[EspNowHeaderSize], m.data()+pos, len);
+	recvCb(mac, frame.data(), frame.size());
+}
+
+static void receiveAll(const uint8_t *mac, long id, const std::vector<uint8_t> &m)
+{
+	int packages = (m.size() + FragmentSize - 1) / FragmentSize;
+
+	for(int n = 1; n<=packages; n++)
+		receive(mac, id, m, n);
+}
+
+static bool delivered(const uint8_t *mac, const std::vector<uint8_t> &m)
+{
+	return deliveries.size() == 1 && memcmp(deliveries[0].mac, mac, 6) == 0 && deliveries[0].data == m;
+}
+
+static bool check(const char *name, bool ok)
+{
+	printf("%-34s %s\n", name, ok ? "ok" : "FAILED");
+	deliveries.clear();
+
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int messages = argc > 1 ? atoi(argv[1]) : 2000;
+	bool ok = true;
+
+	SimpleEspNowConnection c(SimpleEspNowRole::SERVER);
+
+	simpleEspNowConnection = &c;
+	c.begin();
+	c.addPeer(peerA);
+	c.addPeer(peerB);
+	c.onMessage([](uint8_t* mac, const uint8_t* message, size_t len)
+	{
+		Delivery d;
+
+		memcpy(d.mac, mac, 6);
+		d.data.assign(message, message+len);
+		deliveries.push_back(d);
+	});
+
+	std::vector<uint8_t> m = makeMessage(1, 3*FragmentSize - 17);
+
+	receiveAll(peerA, 1, m);
+	ok &= check("three fragments in order", delivered(peerA, m));
+
+	receiveAll(peerA, 1, m);
+	ok &= check("whole message repeated", deliveries.empty());
+
+	m = makeMessage(2, 3*FragmentSize);
+	receive(peerA, 2, m, 1);
+	receive(peerA, 2, m, 2);
+	receive(peerA, 2, m, 2);
+	receive(peerA, 2, m, 1);
+	receive(peerA, 2, m, 3);
+	ok &= check("fragments repeated", delivered(peerA, m));
+
+	m = makeMessage(3, 3*FragmentSize);
+	receive(peerA, 3, m, 1);
+	receive(peerA, 3, m, 3);
+	ok &= check("fragment missing", deliveries.empty());
+
+	m = makeMessage(4, 2*FragmentSize);
+	receiveAll(peerA, 4, m);
+	ok &= check("next message after a missing one", delivered(peerA, m));
+
+	std::vector<uint8_t> a = makeMessage(5, 4*FragmentSize);
+	std::vector<uint8_t> b = makeMessage(5, 2*FragmentSize + 1);
+
+	receive(peerA, 5, a, 1);
+	receive(peerB, 5, b, 1);
+	receive(peerA, 5, a, 2);
+	receive(peerB, 5, b, 2);
+	receive(peerA, 5, a, 3);
+	receive(peerB, 5, b, 3);
+	receive(peerA, 5, a, 4);
+	ok &= check("two senders interleaved", deliveries.size() == 2 &&
+		deliveries[0].data == b && memcmp(deliveries[0].mac, peerB, 6) == 0 &&
+		deliveries[1].data == a && memcmp(deliveries[1].mac, peerA, 6) == 0);
+
+	// fragments of dropped and finished messages have to be released, or the buffer fills up
+	int expected = 0, wrong = 0;
+	size_t count = 0;
+
+	srand(1);
+
+	for(long id = 10; id<10+messages; id++)
+	{
+		std::vector<uint8_t> r = makeMessage(id, 1 + rand() % (6*FragmentSize));
+		int packages = (r.size() + FragmentSize - 1) / FragmentSize;
+		bool lost = packages > 2 && rand() % 4 == 0;
+
+		for(int n = 1; n<=packages; n++)
+		{
+			if(lost && n == 2)
+				continue;
+
+			receive(peerA, id, r, n);
+
+			if(rand() % 8 == 0)
+				receive(peerA, id, r, n);
+		}
+
+		// sent again as the sender did not get the acknowledgement, delivered once
+		bool again = rand() % 8 == 0;
+
+		if(again)
+			receiveAll(peerA, id, r);
+
+		if(!lost || again)
+			expected++;
+
+		if(deliveries.size() > count)
+			wrong += deliveries.back().data != r;
+
+		count = deliveries.size();
+	}
+
+	char name[40];
+
+	snprintf(name, sizeof(name), "%d random messages", messages);
+	ok &= check(name, (int)count == expected && wrong == 0);
+
+	return ok ? 0 : 1;
+}
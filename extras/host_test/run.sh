@@ -0,0 +1,35 @@
+#!/bin/sh
+# Builds the library against the mock core in mock/ and runs the host tests.
+# Needs g++ with C++17 and pthreads, no ESP toolchain.
+#
+#   extras/host_test/run.sh [test ...]
+
+cd "$(dirname "$0")" || exit 1
+
+OUT=${OUT:-/tmp/simpleespnow_host_test}
+CXX=${CXX:-g++}
+FLAGS="-std=gnu++17 -O1 -g -Wall -Werror=return-type -Imock -I../../src"
+TESTS=${*:-"receive_fragments tracked_messages slotted_cell queue_delay publish_bench ota_loss stress_tasks engine_bench"}
+
+mkdir -p "$OUT" || exit 1
+
+# both targets have to compile, only the ESP32 build is run
+for target in ESP32 ESP8266
+do
+	$CXX $FLAGS -D$target -fsyntax-only ../../src/SimpleEspNowConnection.cpp || exit 1
+done
+
+# ESP-IDF 5.4 brings ESP-NOW v2 frames, 5.5 the new send callback
+for idf in 5.4 5.5
+do
+	$CXX $FLAGS -DESP32 -DMOCK_IDF_MAJOR=${idf%.*} -DMOCK_IDF_MINOR=${idf#*.} -fsyntax-only ../../src/SimpleEspNowConnection.cpp || exit 1
+done
+
+for t in $TESTS
+do
+	echo "== $t"
+	$CXX $FLAGS -DESP32 $t.cpp mock/mock.cpp -o "$OUT/$t" -lpthread || exit 1
+	"$OUT/$t" || { echo "$t FAILED"; exit 1; }
+done
+
+echo "all passed"
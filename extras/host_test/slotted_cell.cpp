@@ -0,0 +1,250 @@
+// Simulated cell of one server and up to 60 sensor clients which all wake up
+// and send a reading at the same moment, first without and then with the
+// slotted mode of the server.
+//
+// The radio is one shared channel with 1 ms transmit ticks. Frames started in
+// the same tick collide and are retried after a random backoff, like the MAC
+// layer retries of ESP-NOW. A frame which still collides after MacRetries
+// retries is reported as failed to the send callback.
+//
+//   slotted_cell [clients] [seconds]
+
+#include "../../src/SimpleEspNowConnection.cpp"
+#include "mock.h"
+
+#include <deque>
+
+#define MaxClients 60
+#define MacRetries 7
+#define ReadingPeriod 1000	// ms between two readings of a client
+#define WarmUp 3000			// ms for CONNECT, time sync and slot assignment
+
+typedef struct Node
+{
+	SimpleEspNowConnection *conn;
+	uint8_t mac[6];
+	std::deque<SentFrame> tx;	// frames handed to the radio
+	int attempts;
+	int backoff;
+} Node;
+
+typedef struct Result
+{
+	long readings;
+	long delivered;
+	long collisions;	// frames lost in a collision
+	long retries;
+	long failed;
+	unsigned long latencySum;
+	unsigned long latencyMax;
+	int withSlot;
+} Result;
+
+static Node nodes[1+MaxClients];
+static int nodeCount;
+static Result result;
+
+static void collect(Node &n)
+{
+	for(auto &f : sentFrames)
+		n.tx.push_back(f);
+
+	sentFrames.clear();
+}
+
+static void call(Node &n, std::function<void(void)> fn)
+{
+	simpleEspNowConnection = n.conn;
+	fn();
+	collect(n);
+}
+
+static Node *findNode(const std::vector<uint8_t> &mac)
+{
+	for(int i = 0; i<nodeCount; i++)
+	{
+		if(memcmp(nodes[i].mac, mac.data(), 6) == 0)
+			return &nodes[i];
+	}
+
+	return NULL;
+}
+
+static void radioTick()
+{
+	std::vector<Node*> contenders;
+
+	for(int i = 0; i<nodeCount; i++)
+	{
+		if(nodes[i].tx.empty())
+			continue;
+
+		if(nodes[i].backoff > 0)
+			nodes[i].backoff--;
+		else
+			contenders.push_back(&nodes[i]);
+	}
+
+	if(contenders.size() == 1)
+	{
+		Node *src = contenders[0];
+		SentFrame f = src->tx.front();
+		Node *dst = findNode(f.mac);
+
+		src->tx.pop_front();
+		src->attempts = 0;
+
+		if(dst != NULL)
+			call(*dst, [&]{ recvCb(src->mac, f.data.data(), f.data.size()); });
+
+		call(*src, [&]{ sendCb(f.mac.data(), ESP_NOW_SEND_SUCCESS); });
+
+		return;
+	}
+
+	for(Node *n : contenders)
+	{
+		result.collisions++;
+
+		if(++n->attempts > MacRetries)
+		{
+			SentFrame f = n->tx.front();
+
+			n->tx.pop_front();
+			n->attempts = 0;
+			result.failed++;
+			call(*n, [&]{ sendCb(f.mac.data(), ESP_NOW_SEND_FAIL); });
+		}
+		else
+		{
+			result.retries++;
+			n->backoff = rand() % (1 << (n->attempts < 5 ? n->attempts : 5)) + 1;
+		}
+	}
+}
+
+static Result runCell(int clients, int seconds, bool slotted)
+{
+	srand(1);
+	mockVirtualClock = true;
+	mockMillisOffset = 1000;
+	nodeCount = clients + 1;
+
+	for(int i = 0; i<nodeCount; i++)
+	{
+		uint8_t mac[6] = {0x02, 0x00, 0x00, 0x00, (uint8_t)(i >> 8), (uint8_t)i};
+
+		memcpy(nodes[i].mac, mac, 6);
+		memcpy(mockMacAddress, mac, 6);
+		nodes[i].tx.clear();
+		nodes[i].attempts = 0;
+		nodes[i].backoff = 0;
+		nodes[i].conn = new SimpleEspNowConnection(i == 0 ? SimpleEspNowRole::SERVER : SimpleEspNowRole::CLIENT);
+		call(nodes[i], [&]{ nodes[i].conn->begin(); });
+	}
+
+	Node &server = nodes[0];
+
+	server.conn->onMessage([](uint8_t*, const uint8_t* message, size_t len)
+	{
+		uint32_t sent;
+
+		if(len < 4)
+			return;
+
+		memcpy(&sent, message, 4);
+
+		unsigned long latency = millis() - sent;
+
+		result.delivered++;
+		result.latencySum += latency;
+
+		if(latency > result.latencyMax)
+			result.latencyMax = latency;
+	});
+
+	unsigned long start = millis();
+	unsigned long measure = start + WarmUp;
+	unsigned long end = measure + seconds * 1000UL;
+
+	memset(&result, 0, sizeof(result));
+
+	while(millis() < end + ReadingPeriod)
+	{
+		unsigned long now = millis();
+
+		if(now == measure)
+			memset(&result, 0, sizeof(result));
+
+		// switched on when all clients are known, the server tells all of them at once
+		if(slotted && now == start + (unsigned long)nodeCount * 20)
+		{
+			uint16_t slotMs = ReadingPeriod / clients;
+
+			call(server, [&]{ server.conn->setSlottedMode(ReadingPeriod, slotMs < SlotGuardTime+2 ? SlotGuardTime+2 : slotMs); });
+		}
+
+		for(int i = 0; i<nodeCount; i++)
+		{
+			Node &n = nodes[i];
+
+			// the clients join one after the other, then all of them send at the same moment
+			if(i > 0 && now == start + (unsigned long)i * 20)
+				call(n, [&]{ n.conn->setServerMac(server.mac); });
+
+			if(i > 0 && now >= measure && now < end && (now - measure) % ReadingPeriod == 0)
+			{
+				uint8_t reading[20];
+				uint32_t t = now;
+
+				memset(reading, 0, sizeof(reading));
+				memcpy(reading, &t, 4);
+
+				call(n, [&]{ if(n.conn->sendMessage(reading, sizeof(reading), server.mac) != 0) result.readings++; });
+			}
+
+			call(n, [&]{ n.conn->loop(); });
+		}
+
+		radioTick();
+		mockMillisOffset++;
+	}
+
+	for(int i = 1; i<nodeCount; i++)
+	{
+		if(nodes[i].conn->getTransmitSlot() >= 0)
+			result.withSlot++;
+	}
+
+	for(int i = 0; i<nodeCount; i++)
+		delete nodes[i].conn;
+
+	return result;
+}
+
+static void print(const char *mode, const Result &r, int clients)
+{
+	printf("%-10s %8ld %9ld %10ld %8ld %7ld %12.1f %11lu %6d/%d\n", mode, r.readings, r.delivered, r.collisions, r.retries, r.failed,
+		r.delivered ? (double)r.latencySum / r.delivered : 0.0, r.latencyMax, r.withSlot, clients);
+}
+
+int main(int argc, char **argv)
+{
+	int clients = argc > 1 ? atoi(argv[1]) : 50;
+	int seconds = argc > 2 ? atoi(argv[2]) : 60;
+
+	if(clients < 1 || clients > MaxClients)
+		return 1;
+
+	Result plain = runCell(clients, seconds, false);
+	Result slotted = runCell(clients, seconds, true);
+
+	printf("%d clients, one reading per client every %d ms, %d s\n", clients, ReadingPeriod, seconds);
+	printf("%-10s %8s %9s %10s %8s %7s %12s %11s %8s\n", "mode", "readings", "delivered", "collisions", "retries", "failed", "latency mean", "latency max", "slot");
+	print("plain", plain, clients);
+	print("slotted", slotted, clients);
+
+	// every client has to know its slot, and the slots have to remove the collisions
+	return slotted.withSlot == clients && slotted.delivered == slotted.readings &&
+		   slotted.collisions < plain.collisions ? 0 : 1;
+}
@@ -0,0 +1,202 @@
+// Several tasks queue messages of random length for three peers at the same
+// time while loop() sends them, a radio task completes the frames and an
+// observer reads the trace and the statistics. Every accepted message has to
+// arrive complete, in order and reported to onMessageComplete.
+//
+// Afterwards esp_now_send() refuses frames, which have no send callback.
+// The messages have to fail instead of keeping the queue waiting.
+//
+//   stress_tasks [messages per task] [queue limit per peer]
+
+#include "../../src/SimpleEspNowConnection.cpp"
+#include "mock.h"
+
+#include <map>
+#include <thread>
+
+#define Producers 4
+
+static uint8_t macs[Producers][6] = {{1,1,1,1,1,1}, {2,2,2,2,2,2}, {3,3,3,3,3,3}, {1,1,1,1,1,1}};
+static std::atomic<int> accepted{0}, rejected{0}, completed{0}, delivered{0}, failed{0};
+static std::atomic<bool> producersDone{false}, stop{false};
+static std::atomic<int> pendingCb{0};
+static uint8_t pendingMac[6];
+
+static uint8_t pattern(int p, int seq, int i)
+{
+	return (uint8_t)(p*31 + seq*7 + i);
+}
+
+static void produce(SimpleEspNowConnection *c, int p, int count)
+{
+	srand(p+1);
+
+	for(int seq = 0; seq<count; seq++)
+	{
+		int len = 7 + rand() % 600;
+		std::vector<uint8_t> m(len);
+
+		m[0] = p;
+		memcpy(&m[1], &seq, 4);
+		m[5] = len & 0xFF;
+		m[6] = len >> 8;
+
+		for(int i = 7; i<len; i++)
+			m[i] = pattern(p, seq, i);
+
+		// a full queue rejects the message, the task tries again
+		while(c->sendMessage(m.data(), len, macs[p]) == 0)
+		{
+			rejected++;
+			std::this_thread::yield();
+		}
+
+		accepted++;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int perProducer = argc > 1 ? atoi(argv[1]) : 400;
+	int received = 0, errors = 0;
+	size_t seen = 0;
+	std::map<std::pair<int, long>, std::vector<uint8_t>> partial;
+	std::map<int, int> nextSeq;
+
+	SimpleEspNowConnection c(SimpleEspNowRole::SERVER);
+
+	simpleEspNowConnection = &c;
+	c.begin();
+	c.setPeerQueueLimit(argc > 2 ? atoi(argv[2]) : 20);
+	c.onMessageComplete([](uint8_t*, SimpleEspNowMessageStatus_t s)
+	{
+		completed++;
+
+		if(s.state == MESSAGE_DELIVERED)
+			delivered++;
+		if(s.state == MESSAGE_FAILED)
+			failed++;
+	});
+
+	std::vector<std::thread> producers;
+
+	for(int p = 0; p<Producers; p++)
+		producers.emplace_back(produce, &c, p, perProducer);
+
+	// completes the frame in flight like the WiFi task
+	std::thread radio([]
+	{
+		while(!stop)
+		{
+			if(pendingCb.load())
+			{
+				uint8_t mac[6];
+
+				memcpy(mac, pendingMac, 6);
+				pendingCb = 0;
+				sendCb(mac, ESP_NOW_SEND_SUCCESS);
+			}
+			else
+				std::this_thread::yield();
+		}
+	});
+
+	std::thread observer([&c]
+	{
+		SimpleEspNowTraceRecord_t records[TraceBufferSize];
+
+		while(!stop)
+		{
+			c.getTrace(records, TraceBufferSize);
+			c.getQueueStatistics(macs[0]);
+			std::this_thread::yield();
+		}
+	});
+
+	// loop() context, reassembles the frames of every producer
+	while(true)
+	{
+		c.loop();
+
+		std::lock_guard<std::mutex> lock(sentLock);
+
+		while(seen < sentFrames.size())
+		{
+			SentFrame &f = sentFrames[seen++];
+			std::vector<uint8_t> &d = f.data;
+			long id;
+
+			memcpy(pendingMac, f.mac.data(), 6);
+			pendingCb = 1;
+			memcpy(&id, &d[3], 4);
+
+			std::vector<uint8_t> &buf = partial[std::make_pair((int)f.mac[0], id)];
+
+			if(buf.empty() && d[1] != 1)
+				errors++;	// first fragment missing
+
+			buf.insert(buf.end(), d.begin()+EspNowHeaderSize, d.end());
+
+			if(d[1] != d[2])
+				continue;
+
+			int p = buf[0], seq, len = buf[5] | (buf[6] << 8);
+
+			memcpy(&seq, &buf[1], 4);
+
+			bool ok = (int)buf.size() == len && nextSeq[p] == seq;
+
+			for(int i = 7; ok && i<len; i++)
+				ok = buf[i] == pattern(p, seq, i);
+
+			if(ok)
+				nextSeq[p] = seq+1;
+			else
+				errors++;
+
+			received++;
+			partial.erase(std::make_pair((int)f.mac[0], id));
+		}
+
+		if(producersDone && c.isSendBufferEmpty() && !pendingCb)
+			break;
+
+		if(accepted == Producers * perProducer)
+			producersDone = true;
+	}
+
+	for(auto &t : producers)
+		t.join();
+
+	for(int w = 0; completed < accepted && w<1000000; w++)
+		std::this_thread::yield();
+
+	stop = true;
+	radio.join();
+	observer.join();
+
+	printf("%d tasks: accepted %d rejected %d received %d completed %d delivered %d errors %d\n",
+		Producers, accepted.load(), rejected.load(), received, completed.load(), delivered.load(), errors);
+
+	bool ok = accepted == Producers * perProducer && received == accepted && completed == accepted && errors == 0 && partial.empty();
+
+	// refused frames, no send callback follows
+	int refused = 8;
+	uint8_t message[300];
+
+	memset(message, 0, sizeof(message));
+	completed = 0;
+	failed = 0;
+	mockSendResult = ESP_FAIL;
+
+	for(int i = 0; i<refused; i++)
+		ok &= c.sendMessage(message, sizeof(message), macs[i%3]) != 0;
+
+	for(int i = 0; i<1000 && !c.isSendBufferEmpty(); i++)
+		c.loop();
+
+	mockSendResult = 0;
+	printf("refused by esp_now_send: completed %d failed %d, queue %s\n", completed.load(), failed.load(), c.isSendBufferEmpty() ? "empty" : "stalled");
+
+	return ok && completed == refused && failed == refused && c.isSendBufferEmpty() ? 0 : 1;
+}
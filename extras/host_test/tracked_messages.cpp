@@ -0,0 +1,75 @@
+// A long message to one client stays pending while requests, which are not
+// tracked, and small messages to other clients pass it. sendMessage() must
+// only be refused when the send buffer is full, not because the untracked
+// traffic moved the message ids on.
+//
+//   tracked_messages [ms]
+
+#include "../../src/SimpleEspNowConnection.cpp"
+#include "mock.h"
+
+#define Clients 4			// the first one gets the long message
+#define LongSize 6000
+
+static uint8_t macs[Clients][6] = {{2,0,0,0,0,1}, {2,0,0,0,0,2}, {2,0,0,0,0,3}, {2,0,0,0,0,4}};
+
+int main(int argc, char **argv)
+{
+	unsigned long duration = argc > 1 ? atol(argv[1]) : 2000;
+	uint8_t longMessage[LongSize], small[20];
+	long accepted = 0, refused = 0, completed = 0, requests = 0;
+
+	memset(longMessage, 0xAA, sizeof(longMessage));
+	memset(small, 0x55, sizeof(small));
+	mockVirtualClock = true;
+	mockMillisOffset = 1000;
+
+	SimpleEspNowConnection c(SimpleEspNowRole::SERVER);
+
+	simpleEspNowConnection = &c;
+	c.begin();
+	c.onMessageComplete([&](uint8_t*, SimpleEspNowMessageStatus_t s) { completed += s.state == MESSAGE_DELIVERED; });
+
+	for(int i = 0; i<Clients; i++)
+		c.addPeer(macs[i]);
+
+	for(unsigned long t = 0; t<duration; t++)
+	{
+		int queued = 0;
+
+		for(int i = 0; i<Clients; i++)
+			queued += c.getQueueStatistics(macs[i]).queued;
+
+		if(c.getQueueStatistics(macs[0]).queued == 0 && c.sendMessage(longMessage, sizeof(longMessage), macs[0]) != 0)
+			accepted++;
+
+		// untracked traffic, it takes message ids as well, loop() times the requests out
+		if(t % 2 == 0)
+			requests += c.request(macs[1 + t/2 % (Clients-1)], small, sizeof(small), 5, [](uint8_t*, uint16_t, SimpleEspNowRequestResult_t, const uint8_t*, size_t) {}) != 0;
+
+		// refused although there is room in the send buffer
+		if(t % 4 == 1 && queued + 2 < MaxBufferSize)
+		{
+			if(c.sendMessage(small, sizeof(small), macs[1 + t % (Clients-1)]) != 0)
+				accepted++;
+			else
+				refused++;
+		}
+
+		c.loop();
+
+		if(!sentFrames.empty())
+		{
+			SentFrame f = sentFrames.back();
+
+			sentFrames.clear();
+			sendCb(f.mac.data(), ESP_NOW_SEND_SUCCESS);
+		}
+
+		mockMillisOffset++;
+	}
+
+	printf("%ld messages accepted, %ld refused with room in the buffer, %ld completed, %ld requests\n", accepted, refused, completed, requests);
+
+	return refused == 0 && accepted > 0 && completed > 0 ? 0 : 1;
+}
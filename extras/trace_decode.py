@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+"""
+trace_decode.py - Decodes the event trace of SimpleEspNowConnection.
+
+Call dumpTrace(Serial) on the device, save the serial output to a file (any
+other output around the dump is ignored) and run
+
+    python3 trace_decode.py serial.log
+
+The script prints a timeline of all events and a latency breakdown per
+message. Several dumps in one file are decoded one after the other.
+"""
+
+import argparse
+import struct
+import sys
+
+RECORD = struct.Struct("<IBBBBI")  # SimpleEspNowTraceRecord_t, 12 bytes
+
+EVENTS = {
+    1: "QUEUE",
+    2: "REJECT",
+    3: "SEND",
+    4: "SEND_DONE",
+    5: "COMPLETE",
+    6: "DROP",
+    7: "SLOT_WAIT",
+    8: "RECEIVE",
+    9: "DUPLICATE",
+    10: "DELIVER",
+    11: "INCOMPLETE",
+    12: "BEACON",
+    13: "PAIRING_END",
+}
+
+TYPES = {1: "DATA", 2: "PAIR", 3: "CONNECT", 4: "RELAY", 5: "REQUEST",
+         6: "RESPONSE", 7: "TIMESYNC", 8: "SLOT", 9: "SUBSCRIBE", 10: "PUBLISH",
+         11: "OTA"}
+
+STATES = {0: "UNKNOWN", 1: "PENDING", 2: "DELIVERED", 3: "FAILED"}
+
+
+class Dump:
+    def __init__(self, address, dump_time):
+        self.address = address
+        self.dump_time = dump_time
+        self.records = []
+        self.peers = {}
+
+    def peer_name(self, peer):
+        if peer == 0xFF:
+            return "-"
+        return self.peers.get(peer, "#%d" % peer)
+
+
+def read_dumps(lines):
+    dump = None
+
+    for line in lines:
+        line = line.strip()
+
+        if line.startswith("#TRACE BEGIN"):
+            parts = line.split()
+            dump = Dump(parts[2] if len(parts) > 2 else "?",
+                        int(parts[4]) if len(parts) > 4 else None)
+        elif dump is None:
+            continue
+        elif line.startswith("#TRACE END"):
+            yield dump
+            dump = None
+        elif line.startswith("#PEER"):
+            parts = line.split()
+            dump.peers[int(parts[1])] = parts[2]
+        elif len(line) == 2 * RECORD.size:
+            try:
+                dump.records.append(RECORD.unpack(bytes.fromhex(line)))
+            except ValueError:
+                pass  # garbled line
+
+
+def unwrap(records):
+    """micros() wraps after about 71 minutes, make the time monotonic."""
+    result = []
+    offset = 0
+    last = None
+
+    for time, event, peer, fragment, status, msg_id in records:
+        if last is not None and time < last:
+            offset += 1 << 32
+        last = time
+        result.append((time + offset, event, peer, fragment, status, msg_id))
+
+    return result
+
+
+def describe(event, fragment, status):
+    if event in (1, 2, 3, 8, 9, 10, 11):
+        kind = TYPES.get(status & 0x7F, str(status))
+        if status & 0x80:
+            kind += "+TS"
+        return "frag %-3d %s" % (fragment, kind)
+    if event == 4:
+        return "ok" if status == 0 else "failed (%d)" % status
+    if event == 5:
+        return "%d fragments %s" % (fragment, STATES.get(status, str(status)))
+    if event in (6, 7):
+        return "frag %d" % fragment
+    if event in (12, 13):
+        return "beacon %d" % fragment
+    return ""
+
+
+def print_timeline(dump, records):
+    start = records[0][0]
+
+    print("Timeline")
+    for time, event, peer, fragment, status, msg_id in records:
+        print("  %10.3f ms  %-11s peer %-12s id %-10s %s" % (
+            (time - start) / 1000.0,
+            EVENTS.get(event, "EVENT%d" % event),
+            dump.peer_name(peer),
+            msg_id if msg_id else "-",
+            describe(event, fragment, status)))
+
+
+def print_messages(dump, records):
+    outgoing = {}
+    incoming = {}
+    last_send = None
+
+    for time, event, peer, fragment, status, msg_id in records:
+        key = (peer, msg_id)
+
+        if event == 1:
+            outgoing[key] = {"queued": time, "fragments": fragment,
+                             "first": None, "done": None, "result": "pending"}
+        elif event == 3:
+            last_send = key
+            msg = outgoing.setdefault(key, {"queued": None, "fragments": None,
+                                            "first": None, "done": None,
+                                            "result": "pending"})
+            if msg["first"] is None:
+                msg["first"] = time
+        elif event == 4 and last_send in outgoing:
+            # all frames leave through the send queue, one at a time, so the
+            # callback belongs to the last send. Control frames have no SEND
+            # record and leave last_send empty.
+            msg = outgoing[last_send]
+            msg["done"] = time
+            if status != 0:
+                msg["result"] = "failed"
+            last_send = None
+        elif event == 5 and key in outgoing:
+            outgoing[key]["result"] = STATES.get(status, str(status)).lower()
+        elif event == 8 and msg_id and (status & 0x7F) in (1, 5, 6, 9, 10, 11):
+            incoming.setdefault(key, {"first": time, "fragments": 0, "end": None,
+                                      "result": "incomplete"})
+            incoming[key]["fragments"] += 1
+        elif event == 9 and key in incoming:
+            incoming[key]["fragments"] -= 1  # counted by its RECEIVE event already
+        elif event in (10, 11) and key in incoming:
+            incoming[key]["end"] = time
+            incoming[key]["result"] = "delivered" if event == 10 else "dropped"
+
+    def ms(a, b):
+        return "%9.3f" % ((b - a) / 1000.0) if a is not None and b is not None else "        -"
+
+    print("Sent messages (ms)             frags     queue  transmit     total  result")
+    for (peer, msg_id), msg in outgoing.items():
+        print("  %-12s %-10d      %5s %s %s %s  %s" % (
+            dump.peer_name(peer), msg_id,
+            msg["fragments"] if msg["fragments"] is not None else "?",
+            ms(msg["queued"], msg["first"]),
+            ms(msg["first"], msg["done"]),
+            ms(msg["queued"], msg["done"]),
+            msg["result"]))
+
+    print("Received messages (ms)         frags  reassembly  result")
+    for (peer, msg_id), msg in incoming.items():
+        print("  %-12s %-10d      %5d   %s  %s" % (
+            dump.peer_name(peer), msg_id, msg["fragments"],
+            ms(msg["first"], msg["end"]), msg["result"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode SimpleEspNowConnection trace dumps")
+    parser.add_argument("file", nargs="?", help="serial log, stdin if omitted")
+    parser.add_argument("--no-timeline", action="store_true", help="print the message summary only")
+    args = parser.parse_args()
+
+    lines = open(args.file, errors="replace") if args.file else sys.stdin
+    found = False
+
+    for dump in read_dumps(lines):
+        found = True
+        print("Trace of %s, %d records" % (dump.address, len(dump.records)))
+
+        if not dump.records:
+            continue
+
+        records = unwrap(dump.records)
+
+        if not args.no_timeline:
+            print_timeline(dump, records)
+        print_messages(dump, records)
+        print()
+
+    if not found:
+        sys.exit("no trace dump found")
+
+
+if __name__ == "__main__":
+    main()
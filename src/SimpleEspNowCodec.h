@@ -0,0 +1,327 @@
+/*
+  SimpleEspNowCodec.h - Compact binary encoding of message structs for
+  SimpleEspNowConnection. The fields are declared once in a schema method of
+  the struct, the same method is used for encoding and decoding:
+
+    typedef struct SensorData {
+      uint16_t id;
+      float temperature;
+      bool alarm;
+
+      static const uint8_t SchemaVersion = 1;
+
+      void schema(SimpleEspNowCodec& codec)
+      {
+        codec.field(id);
+        codec.field(temperature, 100);	// fixed point, 2 decimals
+        codec.field(alarm);
+      }
+    } SensorData;
+
+  Integers are written as varints (signed ones zigzag encoded), booleans are
+  packed into bits, floats can be scaled to fixed point and strings are length
+  prefixed. The first byte of a message is the schema version, newer fields can
+  be made conditional with codec.version() when the schema is extended.
+*/
+
+#ifndef SIMPLEESPNOWCODEC_H
+#define SIMPLEESPNOWCODEC_H
+
+#include <Arduino.h>
+#include <type_traits>
+
+class SimpleEspNowCodec
+{
+  public:
+	SimpleEspNowCodec(uint8_t* buffer, size_t size, bool decoding = false)
+	{
+		_buffer = buffer;
+		_size = size;
+		_pos = 0;
+		_decoding = decoding;
+		_ok = buffer != NULL;
+		_version = 0;
+		_bitByte = 0;
+		_bitPos = 8;
+	}
+
+	// Encodes msg into buffer, returns the number of bytes written or 0 if the
+	// buffer is too small.
+	template<typename T> static size_t encode(T& msg, uint8_t* buffer, size_t size)
+	{
+		SimpleEspNowCodec codec(buffer, size);
+
+		codec._version = T::SchemaVersion;
+		codec.putByte(codec._version);
+		msg.schema(codec);
+
+		return codec.ok() ? codec.length() : 0;
+	}
+
+	// Decodes a message in place into msg. Fails for unknown schema versions
+	// and if the message does not match the schema, msg can be partly
+	// overwritten in this case.
+	template<typename T> static bool decode(T& msg, const uint8_t* buffer, size_t len)
+	{
+		SimpleEspNowCodec codec((uint8_t*)buffer, len, true);
+
+		if(len == 0 || buffer[0] == 0 || buffer[0] > T::SchemaVersion)
+			return false;
+
+		codec._version = buffer[0];
+		codec._pos = 1;
+		msg.schema(codec);
+
+		return codec.ok() && codec.length() == len;
+	}
+
+	bool ok() { return _ok; }
+	bool isDecoding() { return _decoding; }
+	size_t length() { return _pos; }
+	uint8_t version() { return _version; }
+
+	template<typename T> void field(T& value)
+	{
+		static_assert(std::is_integral<T>::value, "use field(value, scale) or field(float&) for floating point values");
+
+		if(std::is_signed<T>::value)
+		{
+			int64_t v = value;
+
+			if(!_decoding)
+			{
+				putVarint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63)); // zigzag, small negative values stay short
+				return;
+			}
+
+			uint64_t u;
+
+			if(!getVarint(u))
+				return;
+
+			v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+			value = (T)v;
+
+			if((int64_t)value != v)
+				_ok = false;
+		}
+		else
+		{
+			uint64_t u = value;
+
+			if(!_decoding)
+			{
+				putVarint(u);
+				return;
+			}
+
+			if(!getVarint(u))
+				return;
+
+			value = (T)u;
+
+			if((uint64_t)value != u)
+				_ok = false;
+		}
+	}
+
+	void field(bool& value)
+	{
+		// up to 8 consecutive or scattered booleans share one byte
+		if(_bitPos >= 8)
+		{
+			uint8_t b = 0;
+
+			if(_decoding ? !getByte(b) : !putByte(b))
+				return;
+
+			_bitByte = _pos - 1;
+			_bitPos = 0;
+		}
+
+		if(_decoding)
+			value = (_buffer[_bitByte] >> _bitPos) & 1;
+		else if(value)
+			_buffer[_bitByte] |= 1 << _bitPos;
+
+		_bitPos++;
+	}
+
+	// fixed point, value*scale is transmitted as a signed varint
+	void field(float& value, float scale)
+	{
+		double v = value;
+
+		field(v, scale);
+
+		if(_decoding)
+			value = (float)v;
+	}
+
+	void field(double& value, double scale)
+	{
+		int64_t v = 0;
+
+		if(!_decoding)
+		{
+			double scaled = value * scale;
+
+			v = (int64_t)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+		}
+
+		field(v);
+
+		if(_decoding)
+			value = (double)v / scale;
+	}
+
+	// full precision, 4 bytes
+	void field(float& value)
+	{
+		bytes((uint8_t*)&value, sizeof(value));
+	}
+
+	// zero terminated string in a buffer of size bytes
+	void field(char* str, size_t size)
+	{
+		if(size == 0)
+		{
+			_ok = false;
+			return;
+		}
+
+		uint64_t len = 0;
+
+		if(!_decoding)
+		{
+			while(len < size-1 && str[len] != 0)
+				len++;
+
+			putVarint(len);
+			bytes((uint8_t*)str, len);
+			return;
+		}
+
+		if(!getVarint(len))
+			return;
+
+		if(len >= size)
+		{
+			_ok = false;
+			return;
+		}
+
+		bytes((uint8_t*)str, len);
+		str[_ok ? len : 0] = 0;
+	}
+
+	void field(String& str)
+	{
+		uint64_t len = str.length();
+
+		if(!_decoding)
+		{
+			putVarint(len);
+			bytes((uint8_t*)str.c_str(), len);
+			return;
+		}
+
+		if(!getVarint(len))
+			return;
+
+		if(len > _size - _pos)
+		{
+			_ok = false;
+			return;
+		}
+
+		str = String();
+
+		for(size_t i = 0; i<len; i++)
+			str += (char)_buffer[_pos++];
+	}
+
+	// fixed number of raw bytes
+	void bytes(uint8_t* data, size_t len)
+	{
+		if(!_ok || len > _size - _pos)
+		{
+			_ok = false;
+			return;
+		}
+
+		if(_decoding)
+			memcpy(data, _buffer+_pos, len);
+		else
+			memcpy(_buffer+_pos, data, len);
+
+		_pos += len;
+	}
+
+  private:
+	bool putByte(uint8_t b)
+	{
+		if(!_ok || _pos >= _size)
+			return _ok = false;
+
+		_buffer[_pos++] = b;
+
+		return true;
+	}
+
+	bool getByte(uint8_t& b)
+	{
+		if(!_ok || _pos >= _size)
+			return _ok = false;
+
+		b = _buffer[_pos++];
+
+		return true;
+	}
+
+	void putVarint(uint64_t v)
+	{
+		do
+		{
+			uint8_t b = v & 0x7F;
+
+			v >>= 7;
+			if(v != 0)
+				b |= 0x80;
+
+			if(!putByte(b))
+				return;
+		} while(v != 0);
+	}
+
+	bool getVarint(uint64_t& v)
+	{
+		v = 0;
+
+		for(int shift = 0; shift < 64; shift += 7)
+		{
+			uint8_t b;
+
+			if(!getByte(b))
+				return false;
+
+			v |= (uint64_t)(b & 0x7F) << shift;
+
+			if((b & 0x80) == 0)
+				return true;
+		}
+
+		return _ok = false;
+	}
+
+	uint8_t* _buffer;
+	size_t _size;
+	size_t _pos;
+	bool _decoding;
+	bool _ok;
+	uint8_t _version;
+	size_t _bitByte;	// byte holding the current booleans
+	uint8_t _bitPos;	// next bit in _bitByte, 8 if a new byte is needed
+};
+
+#endif
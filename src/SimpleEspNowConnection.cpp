@@ -17,37 +17,80 @@
 
 SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject::DeviceBufferObject()
 {
+	_message = NULL;
+	_shared = NULL;
+	_len = 0;
+	_raw = false;
+	_held = false;
+	_received = false;
+	_type = SimpleEspNowMessageType::DATA;
 }
 
-SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject::DeviceBufferObject(long id, int counter, int packages, const uint8_t *device, const uint8_t* message, size_t len)
+SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject::DeviceBufferObject(long id, int counter, int packages, const uint8_t *device, const uint8_t* message, size_t len, uint8_t type)
 {
 	_id = id;
 	memcpy(_device, device, 6);
-	memset(_message, '\0', 235);
+	_message = new uint8_t[len > 0 ? len : 1];
+	_shared = NULL;
 	memcpy(_message, message, len);
 	_len = len;
 	_counter = counter;
 	_packages = packages;	
+	_raw = false;
+	_held = false;
+	_received = false;
+	_type = type;
 }
 
 SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject::DeviceBufferObject(long id, int counter, int packages, const uint8_t *device)
 {
 	_id = id;
 	memcpy(_device, device, 6);
-	memset(_message, '\0', 235);
+	_message = NULL;	// allocated when the fragment arrives
+	_shared = NULL;
 	_len = 0;
 	_counter = counter;
 	_packages = packages;
+	_raw = false;
+	_held = false;
+	_received = false;
+	_type = SimpleEspNowMessageType::DATA;
+}
+
+SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject::DeviceBufferObject(long id, int counter, int packages, const uint8_t *device, SharedPayload_t *payload, size_t pos, size_t len, uint8_t type)
+{
+	_id = id;
+	memcpy(_device, device, 6);
+	_message = payload->data + pos;
+	_shared = payload;	// counted by linkFragments
+	_len = len;
+	_counter = counter;
+	_packages = packages;	
+	_raw = false;
+	_held = false;
+	_received = false;
+	_type = type;
 }
 
 SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject::~DeviceBufferObject()
 {
+	// a shared payload is released by deleteBuffer, its reference count needs the lock
+	if(_shared == NULL && _message != NULL)
+		delete[] _message;
 }
 
 SimpleEspNowConnection::DeviceMessageBuffer::DeviceMessageBuffer()
 {
     for(int i = 0; i<MaxBufferSize; i++)
+	{
 		_dbo[i] = NULL;
+		_queues[i].used = false;
+	}
+	
+	_nextId = 1;
+	_queueLimit = MaxBufferSize;
+	_cursor = 0;
+	_nextSeq = 0;
 }
 
 SimpleEspNowConnection::DeviceMessageBuffer::~DeviceMessageBuffer()
@@ -67,14 +110,106 @@ bool SimpleEspNowConnection::DeviceMessageBuffer::isSendBufferEmpty()
 	return true;
 }
 
-SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject* SimpleEspNowConnection::DeviceMessageBuffer::getNextBuffer()
+int SimpleEspNowConnection::DeviceMessageBuffer::findQueue(const uint8_t *device, bool create)
 {
+	int free = -1;
+	
     for(int i = 0; i<MaxBufferSize; i++)
     {
-		if(_dbo[i] != NULL)
+		if(_queues[i].used && memcmp(_queues[i].device, device, 6) == 0)
+			return i;
+		if(!_queues[i].used && free < 0)
+			free = i;
+	}
+	
+	if(!create || free < 0)
+		return -1;
+	
+	memcpy(_queues[free].device, device, 6);
+	_queues[free].used = true;
+	_queues[free].count = 0;
+	_queues[free].deficit = 0;
+	
+	return free;
+}
+
+int SimpleEspNowConnection::DeviceMessageBuffer::getQueuedCount(const uint8_t *device)
+{
+	EspNowLock(_lock);
+	
+	int q = findQueue(device, false);
+	int count = q < 0 ? 0 : _queues[q].count;
+	
+	EspNowUnlock(_lock);
+	
+	return count;
+}
+
+int SimpleEspNowConnection::DeviceMessageBuffer::getFreeCount()
+{
+	int free = 0;
+	
+    for(int i = 0; i<MaxBufferSize; i++)
+    {
+		if(_dbo[i] == NULL)
+			free++;
+	}
+	
+	return free;
+}
+
+SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject* SimpleEspNowConnection::DeviceMessageBuffer::getQueueHead(const uint8_t *device)
+{
+	DeviceBufferObject *head = NULL;
+	
+    for(int i = 0; i<MaxBufferSize; i++)
+    {
+		if(_dbo[i] != NULL && memcmp(_dbo[i]->_device, device, 6) == 0 &&
+		   (head == NULL || (int32_t)(_dbo[i]->_seq - head->_seq) < 0))
+		{
+			head = _dbo[i];
+		}
+	}
+	
+	return head;
+}
+
+SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject* SimpleEspNowConnection::DeviceMessageBuffer::getNextBuffer()
+{
+	// deficit round robin over the devices, every device gets about one full
+	// frame of bytes per round so a long message does not block the others
+    for(int n = 0; n<3*MaxBufferSize; n++)
+    {
+		DeviceBufferObject *next = NULL;
+		
+		// one step per lock, producers never wait for a whole round
+		EspNowLock(_lock);
+		
+		DeviceQueue_t *q = &_queues[_cursor];
+		
+		if(q->used)
 		{
-			return _dbo[i];
+			DeviceBufferObject *head = getQueueHead(q->device);
+			
+			if(head == NULL)
+				q->used = false;
+			else if(!head->_held)	// a held head blocks its queue until it is released
+			{
+				if(q->deficit >= (int32_t)head->_len)
+					next = head;
+				else
+					q->deficit += EspNowLocalFrameSize;
+			}
 		}
+		
+		if(next == NULL)
+			_cursor = (_cursor + 1) % MaxBufferSize;
+		
+		EspNowUnlock(_lock);
+		
+		// only loop() deletes queued fragments, so next stays valid without the lock
+		if(next != NULL)
+			return next;
 	}
 	
 	return NULL;
@@ -100,31 +235,203 @@ bool SimpleEspNowConnection::DeviceMessageBuffer::createBuffer(const uint8_t *de
 	return true;
 }
 
-bool SimpleEspNowConnection::DeviceMessageBuffer::createBuffer(const uint8_t *device, const uint8_t* message, size_t len)
+bool SimpleEspNowConnection::DeviceMessageBuffer::linkFragments(const uint8_t *device, DeviceBufferObject **fragments, int packages, long *id, SharedPayload_t *payload)
+{
+	unsigned long now = millis();
+	
+	EspNowLock(_lock);
+	
+	int q = findQueue(device, false);
+	int queued = q < 0 ? 0 : _queues[q].count;
+	
+	// the whole message has to fit, a truncated message is useless for the receiver
+	if(packages <= getFreeCount() && queued + packages <= _queueLimit)
+		q = findQueue(device, true);
+	else
+		q = -1;
+	
+	// rejected messages take no id, consecutive ids allow duplicate detection on the receiver
+	if(q >= 0 && id != NULL && *id == 0)
+	{
+		*id = _nextId++;
+		
+		if(_nextId == 0)
+			_nextId = 1;
+	}
+	
+    for(int i = 0, n = 0; q >= 0 && i<MaxBufferSize && n < packages; i++)
+    {
+		if(_dbo[i] == NULL)
+		{
+			if(id != NULL)
+				fragments[n]->_id = *id;
+			
+			fragments[n]->_seq = _nextSeq++;
+			fragments[n]->_queuedAt = now;
+			_dbo[i] = fragments[n++];
+			_queues[q].count++;
+		}
+	}
+	
+	if(q >= 0 && payload != NULL)
+		payload->refs += packages;
+	
+	EspNowUnlock(_lock);
+	
+	return q >= 0;
+}
+
+void SimpleEspNowConnection::DeviceMessageBuffer::releasePayload(SharedPayload_t *payload)
+{
+	EspNowLock(_lock);
+	
+	bool last = --payload->refs == 0;
+	
+	EspNowUnlock(_lock);
+	
+	if(last)
+	{
+		delete[] payload->data;
+		delete payload;
+	}
+}
+
+bool SimpleEspNowConnection::DeviceMessageBuffer::createRawBuffer(const uint8_t *device, const uint8_t* frame, size_t len)
+{
+	if(len > EspNowMaxFrameSize || getFreeCount() == 0)
+		return false;
+	
+	DeviceBufferObject *dbo = new DeviceBufferObject(0, 1, 1, device, frame, len);
+	
+	dbo->_raw = true;
+	
+	if(linkFragments(device, &dbo, 1))
+		return true;
+	
+	delete dbo;
+	
+	return false;
+}
+
+long SimpleEspNowConnection::DeviceMessageBuffer::createBuffer(const uint8_t *device, const uint8_t* message, size_t len, size_t fragmentSize, uint8_t type, bool held)
 {		
-	int packages = len / 235 + 1;
-	int messagelen;
-	int counter = 0;
-	int pos = 0;
-	long id = millis();
+	int packages = len == 0 ? 1 : (len + fragmentSize - 1) / fragmentSize;
+	size_t pos = 0;
+	
+	// checked again by linkFragments, this only saves the allocations if the buffer is full
+	if(packages > 255 || packages > getFreeCount())
+		return 0;
+	
+	long id = 0;	// assigned by linkFragments
+	DeviceBufferObject *fragments[packages];
+	
+	// copied before the lock is taken
+	for(int n = 0; n<packages; n++)
+	{
+		size_t messagelen = len - pos > fragmentSize ? fragmentSize : len - pos;
+		
+		fragments[n] = new DeviceBufferObject(0, n+1, packages, device, message+pos, messagelen, type);
+		fragments[n]->_held = held;
+		pos += fragmentSize;
+	}
+	
+	if(linkFragments(device, fragments, packages, &id))
+		return id;
+	
+	for(int n = 0; n<packages; n++)
+		delete fragments[n];
+	
+	return 0;
+}
 
+void SimpleEspNowConnection::DeviceMessageBuffer::releaseBuffer(const uint8_t *device, long id)
+{
+	EspNowLock(_lock);
+	
     for(int i = 0; i<MaxBufferSize; i++)
     {
-		if(_dbo[i] == NULL)
-		{			
-			messagelen = len - pos > 235 ? 235 : len - pos;
+		if(_dbo[i] != NULL && _dbo[i]->_id == id && memcmp(_dbo[i]->_device, device, 6) == 0)
+			_dbo[i]->_held = false;
+	}
+	
+	EspNowUnlock(_lock);
+}
 
-			_dbo[i] = new DeviceBufferObject(id, counter+1, packages, device, message+(counter*235), messagelen);
+void SimpleEspNowConnection::DeviceMessageBuffer::discardBuffer(const uint8_t *device, long id)
+{
+	DeviceBufferObject *discarded[MaxBufferSize];
+	int count = 0;
+	
+	// only held fragments, they have not been sent and took no deficit
+	EspNowLock(_lock);
+	
+    for(int i = 0; i<MaxBufferSize; i++)
+    {
+		if(_dbo[i] != NULL && _dbo[i]->_held && _dbo[i]->_id == id && memcmp(_dbo[i]->_device, device, 6) == 0)
+		{
+			int q = findQueue(device, false);
 			
-			counter++;
-			pos+=235;
+			if(q >= 0 && --_queues[q].count == 0)
+				_queues[q].used = false;
 			
-			if(counter >= packages)
-				break;
+			discarded[count++] = _dbo[i];
+			_dbo[i] = NULL;
 		}
-    }	
+	}
+	
+	EspNowUnlock(_lock);
+	
+	for(int i = 0; i<count; i++)
+		delete discarded[i];
+}
 
-	return true;
+int SimpleEspNowConnection::DeviceMessageBuffer::createSharedBuffer(const uint8_t (*devices)[6], int count, const uint8_t* message, size_t len, size_t fragmentSize, uint8_t type)
+{
+	int packages = len == 0 ? 1 : (len + fragmentSize - 1) / fragmentSize;
+	int queued = 0;
+	
+	if(packages > 255 || count <= 0)
+		return 0;
+	
+	// the payload is copied once and shared by the fragments of all devices
+	SharedPayload_t *payload = new SharedPayload_t;
+	
+	payload->data = new uint8_t[len > 0 ? len : 1];
+	payload->refs = 1;	// held until all devices are queued
+	memcpy(payload->data, message, len);
+	
+	long id = 0;	// one id for all devices, assigned with the first one
+	DeviceBufferObject *fragments[packages];
+	
+	for(int d = 0; d<count; d++)
+	{
+		// devices with a full queue miss this message, the others still get it
+		if(packages > getFreeCount() || getQueuedCount(devices[d]) + packages > _queueLimit)
+			continue;
+		
+		size_t pos = 0;
+		
+		for(int n = 0; n<packages; n++)
+		{
+			size_t messagelen = len - pos > fragmentSize ? fragmentSize : len - pos;
+			
+			fragments[n] = new DeviceBufferObject(0, n+1, packages, devices[d], payload, pos, messagelen, type);
+			pos += fragmentSize;
+		}
+		
+		if(linkFragments(devices[d], fragments, packages, &id, payload))
+		{
+			queued++;
+			continue;
+		}
+		
+		for(int n = 0; n<packages; n++)
+			delete fragments[n];
+	}
+	
+	releasePayload(payload);
+	
+	return queued;
 }
 
 void SimpleEspNowConnection::DeviceMessageBuffer::addBuffer(const uint8_t *device, long id, uint8_t *buffer, size_t len, int package)
@@ -135,8 +442,13 @@ void SimpleEspNowConnection::DeviceMessageBuffer::addBuffer(const uint8_t *devic
 		 _dbo[i]->_counter == package+1 &&
 		 _dbo[i]->_id == id)
 		{
+			if(_dbo[i]->_message != NULL)
+				delete[] _dbo[i]->_message;
+			
+			_dbo[i]->_message = new uint8_t[len > 0 ? len : 1];
 			memcpy(_dbo[i]->_message, buffer, len);
 			_dbo[i]->_len = len;
+			_dbo[i]->_received = true;
 								
 			break;
 		}
@@ -145,6 +457,31 @@ void SimpleEspNowConnection::DeviceMessageBuffer::addBuffer(const uint8_t *devic
 	
 }
 
+bool SimpleEspNowConnection::DeviceMessageBuffer::hasFragment(const uint8_t *device, long id, int package)
+{
+    for(int i = 0;i<MaxBufferSize; i++)
+	{
+		if(_dbo[i] != NULL && memcmp(_dbo[i]->_device, device, 6) == 0 && 
+		   _dbo[i]->_counter == package+1 && _dbo[i]->_id == id)
+			return _dbo[i]->_received;
+	}
+	
+	return false;
+}
+
+bool SimpleEspNowConnection::DeviceMessageBuffer::isComplete(const uint8_t *device, long id, int packages)
+{
+	int received = 0;
+	
+    for(int i = 0;i<MaxBufferSize; i++)
+	{
+		if(_dbo[i] != NULL && memcmp(_dbo[i]->_device, device, 6) == 0 && _dbo[i]->_id == id && _dbo[i]->_received)
+			received++;
+	}
+	
+	return received == packages;
+}
+
 size_t SimpleEspNowConnection::DeviceMessageBuffer::getBufferSize(const uint8_t *device, long id, int packages)
 {
 	size_t s = 0;
@@ -184,161 +521,507 @@ uint8_t* SimpleEspNowConnection::DeviceMessageBuffer::getBuffer(const uint8_t *d
 
 bool SimpleEspNowConnection::DeviceMessageBuffer::deleteBuffer(const uint8_t *device, long id)
 {
+	bool found = false;
+	
     for(int i = 0;i<MaxBufferSize; i++)
     {
       if(_dbo[i] != NULL && memcmp(_dbo[i]->_device, device, 6) == 0 && _dbo[i]->_id == id)
       {
         delete _dbo[i];
         _dbo[i] = NULL;
+		found = true;
       }
     }	
+	
+	return found;
 }
 
 bool SimpleEspNowConnection::DeviceMessageBuffer::deleteBuffer(SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject* dbo)
 {
+	bool found = false;
+	
+	EspNowLock(_lock);
+	
     for(int i = 0; i<MaxBufferSize; i++)
     {
 		if(_dbo[i] == dbo)
 		{
-			delete _dbo[i];
+			int q = findQueue(dbo->_device, false);
+			
+			if(q >= 0)
+			{
+				_queues[q].deficit -= dbo->_len;
+				
+				if(--_queues[q].count == 0)
+					_queues[q].used = false;
+			}
+			
 			_dbo[i] = NULL;
-			return true;
+			found = true;
+			break;
 		}
 	}
 	
-	return false;
-}
-
-SimpleEspNowConnection::SimpleEspNowConnection(SimpleEspNowRole role) 
-{
-	this->_role = role;
-	simpleEspNowConnection = this;
-	this->_pairingOngoing = false;
-	memset(_serverMac,0,6);
-	_openTransaction = false;
-	_channel = 3;
-	_lastSentTime = millis();
+	EspNowUnlock(_lock);
+	
+	if(!found)
+		return false;
+	
+	if(dbo->_shared != NULL)
+		releasePayload(dbo->_shared);
+	
+	delete dbo;
+	
+	return true;
 }
 
-bool SimpleEspNowConnection::begin()
-{	
-	_supportLooping = true;
-
-#if defined(ESP32)
-#if defined(DISABLE_BROWNOUT)
-	WRITE_PERI_REG(RTC_CNTL_BROWN_OUT_REG, 0);
-#endif
-#endif
-
-	WiFi.mode(WIFI_STA);	
+#define PeerUsed 1
+#define PeerDeleted 2
+#define PeerDatabaseMagic 0x504E4553 // 'SENP'
+#define PeerDatabaseVersion 1
+#define PeerDatabaseHeaderSize 8
+#define SubscriptionsKnown 0xFF
 
-	WiFi.persistent(false);
-	WiFi.macAddress(_myAddress);	
-	myAddress = macToStr(_myAddress);
+static_assert((MaxPeerCount & (MaxPeerCount-1)) == 0, "MaxPeerCount must be a power of two");
+static_assert((TraceBufferSize & (TraceBufferSize-1)) == 0, "TraceBufferSize must be a power of two");
+static_assert(sizeof(SimpleEspNowTraceRecord_t) == 12, "trace records are decoded by extras/trace_decode.py");
 
+SimpleEspNowConnection::PeerDatabase::PeerDatabase()
+{
+	memset(_peers, 0, sizeof(_peers));
+	memset(_state, 0, sizeof(_state));
+	memset(_dirty, 0, sizeof(_dirty));
+	_count = 0;
+	_duplicates = 0;
+	_storage = NULL;
+	_urgent = false;
+}
 
-	if (esp_now_init() != 0) 
+uint32_t SimpleEspNowConnection::PeerDatabase::hashMac(const uint8_t *mac)
+{
+	uint32_t h = 2166136261UL; // FNV-1a
+	
+	for(int i = 0; i<6; i++)
 	{
-		Serial.println("Error initializing ESP-NOW");
-		return false;
+		h ^= mac[i];
+		h *= 16777619UL;
 	}
-
-	
-#if defined(ESP8266)
-	esp_now_set_self_role(ESP_NOW_ROLE_COMBO);
-#endif	
-
-	esp_now_register_recv_cb(SimpleEspNowConnection::onReceiveData);
-
 	
-#if defined(ESP8266)
-	esp_now_register_send_cb([](uint8_t* mac, uint8_t sendStatus) 
-#elif defined(ESP32)		
-	esp_now_register_send_cb([] (const uint8_t *mac, esp_now_send_status_t sendStatus)
-#endif	
-	{//this is the function that is called to send data
-#ifdef DEBUG
-	  Serial.printf("--- send_cb, send done, status = %i\n", sendStatus);
-#endif	
-		simpleEspNowConnection->_lastSentTime = millis();
-		simpleEspNowConnection->_openTransaction = false;
+	return h;
+}
 
-		if(memcmp(mac, simpleEspNowConnection->_pairingMac, 6) != 0)
-		{
-			if(sendStatus != 0 && simpleEspNowConnection->_SendErrorFunction != NULL)
-			{
-			  simpleEspNowConnection->_SendErrorFunction((uint8_t*)mac);
-			}
-			if(sendStatus == 0 && simpleEspNowConnection->_SendDoneFunction != NULL)
-			{
-			  simpleEspNowConnection->_SendDoneFunction((uint8_t*)mac);
-			}	 
-		}		
-	});
+int SimpleEspNowConnection::PeerDatabase::findPeer(const uint8_t *mac)
+{
+	uint32_t h = hashMac(mac);
 	
-	if(this->_role == SimpleEspNowRole::SERVER)
-	{
-		initServer();
-	}
-	else
+	for(int i = 0; i<MaxPeerCount; i++)
 	{
-		initClient();
+		int slot = (h + i) & (MaxPeerCount-1);
+		
+		if(_peers[slot].flags == 0)
+			return -1;
+		if(_peers[slot].flags == PeerUsed && memcmp(_peers[slot].mac, mac, 6) == 0)
+			return slot;
 	}
 	
-	return true;
+	return -1;
 }
 
-bool SimpleEspNowConnection::setPairingBlinkPort(int pairingGPIO, bool invers)
+int SimpleEspNowConnection::PeerDatabase::addPeer(const uint8_t *mac)
 {
-	_pairingGPIO = pairingGPIO;
-	_pairingInvers = invers;
+	int slot = findPeer(mac);
 	
-    pinMode(_pairingGPIO, OUTPUT);
-    digitalWrite(_pairingGPIO, _pairingInvers); 
+	if(slot >= 0)
+		return slot;
+	
+	uint32_t h = hashMac(mac);
+	
+	for(int i = 0; i<MaxPeerCount; i++)
+	{
+		slot = (h + i) & (MaxPeerCount-1);
+		
+		if(_peers[slot].flags != PeerUsed) // empty or deleted slot
+		{
+			memset(&_peers[slot], 0, sizeof(SimpleEspNowPeer_t));
+			memset(&_state[slot], 0, sizeof(PeerState_t));
+			memcpy(_peers[slot].mac, mac, 6);
+			_peers[slot].flags = PeerUsed;
+			_peers[slot].lastSeen = millis();
+			_count++;
+			markDirty(slot);
+			
+			return slot;
+		}
+	}
+	
+	return -1;
+}
+
+bool SimpleEspNowConnection::PeerDatabase::removePeer(const uint8_t *mac)
+{
+	int slot = findPeer(mac);
+	
+	if(slot < 0)
+		return false;
+	
+	memset(&_peers[slot], 0, sizeof(SimpleEspNowPeer_t));
+	memset(&_state[slot], 0, sizeof(PeerState_t));
+	_peers[slot].flags = PeerDeleted; // keep probe chains intact
+	_count--;
+	markDirty(slot);
 	
 	return true;
 }
 
-void SimpleEspNowConnection::pairingTickerServer()
+void SimpleEspNowConnection::PeerDatabase::touchPeer(int slot)
+{
+	EspNowLock(_lock);
+	_peers[slot].lastSeen = millis();
+	_peers[slot].rxCount++;
+	_dirty[slot/8] |= 1 << (slot%8);
+	EspNowUnlock(_lock);
+}
+
+bool SimpleEspNowConnection::PeerDatabase::isDuplicate(int slot, long id)
+{
+	PeerState_t *st = &_state[slot];
+	
+	if(!st->valid)
+		return false;
+	
+	int32_t delta = (int32_t)((uint32_t)id - st->lastId);
+	
+	if(delta > 0 || delta <= -DedupWindowSize-1)
+		return false; // newer message or sender restarted
+	
+	return delta == 0 || (st->window & (1UL << (-delta-1)));
+}
+
+void SimpleEspNowConnection::PeerDatabase::countDuplicate(int slot)
+{
+	_duplicates++;
+	
+	if(slot >= 0)
+		_state[slot].duplicates++;
+}
+
+void SimpleEspNowConnection::PeerDatabase::markReceived(int slot, long id)
+{
+	PeerState_t *st = &_state[slot];
+	int32_t delta = (int32_t)((uint32_t)id - st->lastId);
+	
+	if(!st->valid || delta > DedupWindowSize || delta <= -DedupWindowSize-1)
+	{
+		st->lastId = id;	// start a new window
+		st->window = 0;
+		st->valid = true;
+	}
+	else if(delta > 0)
+	{
+		// the previous lastId becomes bit delta-1
+		st->window = (delta == DedupWindowSize ? 0 : st->window << delta) | (1UL << (delta-1));
+		st->lastId = id;
+	}
+	else if(delta < 0)
+	{
+		st->window |= 1UL << (-delta-1);
+	}
+}
+
+void SimpleEspNowConnection::PeerDatabase::addLatency(int slot, int32_t latency)
+{
+	SimpleEspNowLatencyStatistics_t *st = &_state[slot].latency;
+	uint32_t l = latency < 0 ? 0 : latency; // clocks are synchronized within a few ms only
+	int bucket = 0;
+	
+	while(bucket < LatencyHistogramBuckets-1 && l >= (1UL << bucket))
+		bucket++;
+	
+	if(st->count == 0 || l < st->min)
+		st->min = l;
+	if(l > st->max)
+		st->max = l;
+	
+	st->count++;
+	st->sum += l;
+	st->histogram[bucket]++;
+}
+
+void SimpleEspNowConnection::PeerDatabase::markDirty(int slot, bool urgent)
+{
+	EspNowLock(_lock);
+	_dirty[slot/8] |= 1 << (slot%8);
+	
+	if(urgent)
+		_urgent = true;
+	EspNowUnlock(_lock);
+}
+
+bool SimpleEspNowConnection::PeerDatabase::isFlushUrgent()
+{
+	return _urgent && _storage != NULL;
+}
+
+bool SimpleEspNowConnection::PeerDatabase::writeHeader()
+{
+	uint8_t header[PeerDatabaseHeaderSize];
+	uint32_t magic = PeerDatabaseMagic;
+	uint16_t slots = MaxPeerCount;
+	
+	memcpy(header, &magic, 4);
+	header[4] = PeerDatabaseVersion;
+	header[5] = sizeof(SimpleEspNowPeer_t);
+	memcpy(header+6, &slots, 2);
+	
+	return _storage->write(0, header, PeerDatabaseHeaderSize);
+}
+
+bool SimpleEspNowConnection::PeerDatabase::load(SimpleEspNowPeerStorage *storage)
+{
+	_storage = storage;
+	
+	if(_storage == NULL)
+		return true;
+	
+	if(!_storage->begin(PeerDatabaseHeaderSize + sizeof(_peers)))
+	{
+		_storage = NULL;
+		return false;
+	}
+	
+	uint8_t header[PeerDatabaseHeaderSize];
+	uint32_t magic;
+	uint16_t slots;
+	
+	if(_storage->read(0, header, PeerDatabaseHeaderSize))
+	{
+		memcpy(&magic, header, 4);
+		memcpy(&slots, header+6, 2);
+		
+		if(magic == PeerDatabaseMagic && header[4] == PeerDatabaseVersion && 
+		   header[5] == sizeof(SimpleEspNowPeer_t) && slots == MaxPeerCount &&
+		   _storage->read(PeerDatabaseHeaderSize, (uint8_t *)_peers, sizeof(_peers)))
+		{
+			_count = 0;
+			
+			for(int i = 0; i<MaxPeerCount; i++)
+			{
+				if(_peers[i].flags == PeerUsed)
+				{
+					_peers[i].lastSeen = millis(); // millis() of the previous run means nothing now
+					_count++;
+				}
+			}
+			
+			memset(_dirty, 0, sizeof(_dirty));
+			_urgent = false;
+			
+			return true;
+		}
+	}
+	
+	// no valid database found, start with the peers known so far
+	return writeHeader() && flush(true);
+}
+
+bool SimpleEspNowConnection::PeerDatabase::flush(bool all)
+{
+	if(_storage == NULL)
+		return false;
+	
+	bool written = false;
+	SimpleEspNowPeer_t peer;
+	
+	EspNowLock(_lock);
+	_urgent = false;
+	EspNowUnlock(_lock);
+	
+	for(int i = 0; i<MaxPeerCount; i++)
+	{
+		// the bit is cleared together with taking the copy, so a change
+		// made by the receive callback meanwhile marks the record again
+		EspNowLock(_lock);
+		bool dirty = all || (_dirty[i/8] & (1 << (i%8)));
+		
+		if(dirty)
+		{
+			_dirty[i/8] &= ~(1 << (i%8));
+			memcpy(&peer, &_peers[i], sizeof(SimpleEspNowPeer_t));
+		}
+		EspNowUnlock(_lock);
+		
+		if(!dirty)
+			continue;
+		
+		if(!_storage->write(PeerDatabaseHeaderSize + i * sizeof(SimpleEspNowPeer_t), (uint8_t *)&peer, sizeof(SimpleEspNowPeer_t)))
+		{
+			markDirty(i);
+			return false;
+		}
+		
+		written = true;
+	}
+	
+	return written ? _storage->commit() : true;
+}
+
+SimpleEspNowConnection::SimpleEspNowConnection(SimpleEspNowRole role) 
+{
+	this->_role = role;
+	simpleEspNowConnection = this;
+	this->_pairingOngoing = false;
+	memset(_serverMac,0,6);
+	memset(&_pairingStatistics, 0, sizeof(_pairingStatistics));
+	memset(&_sendStatistics, 0, sizeof(_sendStatistics));
+	_openTransaction = false;
+	_channel = 3;
+	_lastSentTime = millis();
+	_lastPeerFlush = millis();
+	memset(_routes, 0, sizeof(_routes));
+	memset(_relayHistory, 0, sizeof(_relayHistory));
+	memset(_tracked, 0, sizeof(_tracked));
+	memset(_topics, 0, sizeof(_topics));
+	
+	for(int i = 0; i<MaxOtaSessions; i++)
+	{
+		_otaSessions[i].used = false;
+		_otaSessions[i].read = NULL;
+	}
+	
+	for(int i = 0; i<MaxPendingRequests; i++)
+	{
+		_requests[i].used = false;
+		_requests[i].generation = 0;
+		_requests[i].callback = NULL;
+	}
+}
+
+bool SimpleEspNowConnection::begin()
+{	
+	_supportLooping = true;
+	
+	// a restarted sender must not reuse the ids of its last life
+	deviceSendMessageBuffer._nextId = random(1, 0x7FFFFFFF);
+
+#if defined(ESP32)
+#if defined(DISABLE_BROWNOUT)
+	WRITE_PERI_REG(RTC_CNTL_BROWN_OUT_REG, 0);
+#endif
+#endif
+
+	WiFi.mode(WIFI_STA);	
+
+	WiFi.persistent(false);
+	WiFi.macAddress(_myAddress);	
+	myAddress = macToStr(_myAddress);
+
+
+	if (esp_now_init() != 0) 
+	{
+		Serial.println("Error initializing ESP-NOW");
+		return false;
+	}
+
+	
+#if defined(ESP8266)
+	esp_now_set_self_role(ESP_NOW_ROLE_COMBO);
+#endif	
+
+	esp_now_register_recv_cb(SimpleEspNowConnection::onReceiveData);
+
+	
+#if defined(ESP8266)
+	esp_now_register_send_cb([](uint8_t* mac, uint8_t sendStatus) 
+#elif defined(EspNowSendInfo)
+	esp_now_register_send_cb([] (const wifi_tx_info_t *info, esp_now_send_status_t sendStatus)
+#elif defined(ESP32)		
+	esp_now_register_send_cb([] (const uint8_t *mac, esp_now_send_status_t sendStatus)
+#endif	
+	{//this is the function that is called to send data
+#if defined(EspNowSendInfo)
+		const uint8_t *mac = info->des_addr;
+#endif
+#ifdef DEBUG
+	  Serial.printf("--- send_cb, send done, status = %i\n", sendStatus);
+#endif	
+		simpleEspNowConnection->sendDone(mac, sendStatus);
+	});
+	
+	if(this->_role == SimpleEspNowRole::SERVER)
+	{
+		initServer();
+	}
+	else
+	{
+		initClient();
+	}
+	
+	return true;
+}
+
+bool SimpleEspNowConnection::setPairingBlinkPort(int pairingGPIO, bool invers)
+{
+	_pairingGPIO = pairingGPIO;
+	_pairingInvers = invers;
+	
+    pinMode(_pairingGPIO, OUTPUT);
+    digitalWrite(_pairingGPIO, _pairingInvers); 
+	
+	return true;
+}
+
+void SimpleEspNowConnection::sendPairingBeacon()
 {
 #ifdef DEBUG
     Serial.println("EspNowConnection::Pairing request sent..."+
-		String(simpleEspNowConnection->_pairingCounter+1)+"/"+
-		String(simpleEspNowConnection->_pairingMaxCount));
+		String(_pairingCounter+1));
 #endif
 
-	char sendMessage[13];
+	char sendMessage[15];
 	long id = millis();
+	uint16_t frameSize = EspNowLocalFrameSize;
 	
 	sendMessage[0] = SimpleEspNowMessageType::PAIR;	// Type of message
 	sendMessage[1] = 1;	// 1st package
 	sendMessage[2] = 1;	// from 1 package. WIll be enhanced in one of the next versions
 	memcpy(sendMessage+3, &id, 4);	
 
-	memcpy(sendMessage+7, simpleEspNowConnection->_myAddress, 6);
+	memcpy(sendMessage+7, _myAddress, 6);
+	memcpy(sendMessage+13, &frameSize, 2);	// largest frame we accept
 
-#if defined(ESP32)
-	memcpy(&simpleEspNowConnection->_clientMacPeerInfo.peer_addr, simpleEspNowConnection->_pairingMac, 6);
-	esp_now_add_peer(&simpleEspNowConnection->_clientMacPeerInfo);
-#endif
+	queueFrame(_pairingMac, (uint8_t *)sendMessage, sizeof(sendMessage));
 
+	_pairingCounter++;
+	_pairingStatistics.beaconsSent++;
+	trace(TRACE_BEACON, NULL, id, _pairingCounter);
+}
 
-    esp_now_send(simpleEspNowConnection->_pairingMac, 
-		(uint8_t *)sendMessage, 
-		9);
-	
-#if defined(ESP32)
-	esp_now_del_peer(simpleEspNowConnection->_pairingMac);
-#endif
+void SimpleEspNowConnection::pairingTickerServer()
+{
+	unsigned long now = millis();
 	
-	if(simpleEspNowConnection->_pairingMaxCount > 0)
+	if(simpleEspNowConnection->_pairingTimeout > 0 &&
+		now - simpleEspNowConnection->_pairingStartTime >= simpleEspNowConnection->_pairingTimeout)
 	{
-		simpleEspNowConnection->_pairingCounter++;
-		if(simpleEspNowConnection->_pairingCounter >= simpleEspNowConnection->_pairingMaxCount)
-		{
-			simpleEspNowConnection->endPairing();
-		}
+		simpleEspNowConnection->endPairing();
+		return;
 	}
+	
+	if((long)(now - simpleEspNowConnection->_nextBeaconTime) < 0)
+		return;
+	
+	simpleEspNowConnection->sendPairingBeacon();
+	
+	// fast burst first, afterwards double the interval until the maximum is reached
+	uint32_t interval = simpleEspNowConnection->_pairingFastInterval;
+	
+	for(int i = simpleEspNowConnection->_pairingFastCount; i < simpleEspNowConnection->_pairingCounter && interval < simpleEspNowConnection->_pairingMaxInterval; i++)
+		interval *= 2;
+	
+	if(interval > simpleEspNowConnection->_pairingMaxInterval)
+		interval = simpleEspNowConnection->_pairingMaxInterval;
+	
+	simpleEspNowConnection->_nextBeaconTime = now + interval;
 }
 
 void SimpleEspNowConnection::pairingTickerClient()
@@ -358,6 +1041,24 @@ void SimpleEspNowConnection::pairingTickerClient()
 #endif
 }
 
+void SimpleEspNowConnection::pairingReplyClient()
+{
+	uint8_t sendMessage[15];
+	long ids = millis();
+	uint16_t frameSize = EspNowLocalFrameSize;
+
+	sendMessage[0] = SimpleEspNowMessageType::PAIR;	// Type of message
+	sendMessage[1] = 1;	// 1st package
+	sendMessage[2] = 1;	// from 1 package. Will be enhanced in one of the next versions
+	memcpy(sendMessage+3, &ids, 4);	
+	
+	memcpy(sendMessage+7, simpleEspNowConnection->_myAddress, 6);
+	memcpy(sendMessage+13, &frameSize, 2);	// largest frame we accept
+	
+	simpleEspNowConnection->queueFrame(simpleEspNowConnection->_pairingReplyMac, sendMessage, sizeof(sendMessage));
+	simpleEspNowConnection->trace(TRACE_BEACON, simpleEspNowConnection->_pairingReplyMac, ids, 1);
+}
+
 void SimpleEspNowConnection::pairingTickerLED()
 {	
   if(simpleEspNowConnection->_pairingOngoing)
@@ -376,9 +1077,6 @@ bool SimpleEspNowConnection::startPairing(int timeoutSec)
 {	
 	if(_pairingOngoing) return false;
 	
-	if(timeoutSec > 0 && timeoutSec < 5)
-		timeoutSec = 5;
-	
 	if(this->_role == SimpleEspNowRole::SERVER)
 	{
 #ifdef DEBUG
@@ -387,16 +1085,15 @@ bool SimpleEspNowConnection::startPairing(int timeoutSec)
 
 		_pairingOngoing = true;
 		_pairingCounter = 0;
-		if(timeoutSec > 0)
-		{
-			_pairingMaxCount = timeoutSec / 5;
-		}
-		else
-		{
-			_pairingMaxCount = 0;
-		}
+		_pairingStartTime = millis();
+		_pairingTimeout = timeoutSec > 0 ? (unsigned long)timeoutSec * 1000 : 0;
+		memset(&_pairingStatistics, 0, sizeof(_pairingStatistics));
 
-		_pairingTicker.attach(5.0, SimpleEspNowConnection::pairingTickerServer);   
+		// first beacon immediately, the ticker handles burst, backoff and timeout
+		sendPairingBeacon();
+		_nextBeaconTime = _pairingStartTime + _pairingFastInterval;
+
+		_pairingTicker.attach_ms(_pairingFastInterval, SimpleEspNowConnection::pairingTickerServer);   
 		
 		if(_pairingGPIO != -1)
 		{
@@ -439,8 +1136,35 @@ bool SimpleEspNowConnection::startPairing(int timeoutSec)
 	return true;
 }
 
+bool SimpleEspNowConnection::setPairingSchedule(uint32_t fastIntervalMs, int fastCount, uint32_t maxIntervalMs)
+{
+	if(_pairingOngoing || fastIntervalMs < 50 || fastCount < 0 || maxIntervalMs < fastIntervalMs)
+		return false;
+	
+	_pairingFastInterval = fastIntervalMs;
+	_pairingFastCount = fastCount;
+	_pairingMaxInterval = maxIntervalMs;
+	
+	return true;
+}
+
+bool SimpleEspNowConnection::setPairingReplyJitter(uint32_t maxJitterMs)
+{
+	_pairingReplyJitter = maxJitterMs;
+	
+	return true;
+}
+
+SimpleEspNowPairingStatistics_t SimpleEspNowConnection::getPairingStatistics()
+{
+	return _pairingStatistics;
+}
+
 bool SimpleEspNowConnection::endPairing()
 {
+	if(_pairingOngoing)
+		trace(TRACE_PAIRING_END, NULL, 0, _pairingCounter);
+	
 	_pairingOngoing = false;
     _pairingTicker.detach();
 	_pairingTickerBlink.detach();
@@ -464,29 +1188,230 @@ bool SimpleEspNowConnection::endPairing()
 	return true;
 }
 
-void SimpleEspNowConnection::prepareSendPackages(uint8_t* message, size_t len, String address)
+uint32_t SimpleEspNowConnection::prepareSendPackages(uint8_t* message, size_t len, const uint8_t* mac, uint8_t type)
 {
-	uint8_t *mac = strToMac(address.c_str());		
+	size_t fragmentSize = getFragmentSize(mac);
+	bool tracked = isTrackedType(type);
+	
+	// tracked messages are held until their status exists, otherwise the send
+	// callback could complete the first fragment before trackMessage runs
+	long id = deviceSendMessageBuffer.createBuffer(mac, message, len, fragmentSize, type, tracked);
+	int packages = len == 0 ? 1 : (len + fragmentSize - 1) / fragmentSize;
+	
+	// all status slots pending, cannot happen as long as MaxTrackedMessages > MaxBufferSize
+	if(id != 0 && tracked && !trackMessage(id, mac, packages, type))
+	{
+		deviceSendMessageBuffer.discardBuffer(mac, id);
+		id = 0;
+	}
+	
+	if(id != 0)
+	{
+		if(tracked)
+			deviceSendMessageBuffer.releaseBuffer(mac, id);
+		
+		trace(TRACE_QUEUE, mac, id, packages, type);
+		notifyTransmit();
 		
-	deviceSendMessageBuffer.createBuffer(mac, message, len);	
+		return id;
+	}
+	
+	trace(TRACE_REJECT, mac, 0, 0, type);
+	
+	int slot = peerDatabase.findPeer(mac);
+	
+	if(slot >= 0)
+		peerDatabase._state[slot].queue.rejected++;
+	
+	return 0;
 }
 
-bool SimpleEspNowConnection::sendMessage(char* message, String address)
+bool SimpleEspNowConnection::isTrackedType(uint8_t type)
 {
-	return sendMessage((uint8_t*)message, strlen(message)+1, address);
+	// application messages and slot assignments, which are sent again if lost
+	return type == SimpleEspNowMessageType::DATA || type == SimpleEspNowMessageType::SLOT;
 }
 
-bool SimpleEspNowConnection::sendMessage(uint8_t* message, size_t len, String address)
+bool SimpleEspNowConnection::trackMessage(long id, const uint8_t *mac, int packages, uint8_t type)
 {
-	if( (_role == SimpleEspNowRole::SERVER && address.length() != 12 ) ||
-		(_role == SimpleEspNowRole::CLIENT && _serverMac[0] == 0 ))
+	TrackedMessage_t *t = NULL;
+	unsigned long now = millis();
+	
+	EspNowLock(_lock);
+	
+	// untracked traffic uses ids as well, so the slot does not follow from the id
+	for(int n = 0; n<MaxTrackedMessages && t == NULL; n++)
+	{
+		TrackedMessage_t *candidate = &_tracked[_trackedNext];
+		
+		_trackedNext = (_trackedNext + 1) % MaxTrackedMessages;
+		
+		if(candidate->status.state != MESSAGE_PENDING)
+			t = candidate;
+	}
+	
+	if(t == NULL)
+	{
+		EspNowUnlock(_lock);
+		return false;
+	}
+	
+	memcpy(t->device, mac, 6);
+	t->queuedAt = now;
+	t->type = type;
+	memset(&t->status, 0, sizeof(SimpleEspNowMessageStatus_t));
+	t->status.handle = id;
+	t->status.state = MESSAGE_PENDING;
+	t->status.fragments = packages;
+	
+	EspNowUnlock(_lock);
+	
+	return true;
+}
+
+
+int SimpleEspNowConnection::findTracked(long id)
+{
+	// called with _lock held
+	for(int i = 0; i<MaxTrackedMessages; i++)
+	{
+		if(id != 0 && _tracked[i].status.handle == (uint32_t)id)
+			return i;
+	}
+	
+	return -1;
+}
+
+bool SimpleEspNowConnection::isMessageFailed(long id)
+{
+	EspNowLock(_lock);
+	
+	int i = findTracked(id);
+	bool failed = i >= 0 && _tracked[i].status.state == MESSAGE_FAILED;
+	
+	EspNowUnlock(_lock);
+	
+	return failed;
+}
+
+void SimpleEspNowConnection::completeFragment(long id, bool success)
+{
+	TrackedMessage_t done;
+	bool complete = false;
+	unsigned long now = millis();
+	
+	EspNowLock(_lock);
+	
+	int i = findTracked(id);
+	TrackedMessage_t *t = i >= 0 ? &_tracked[i] : NULL;
+	
+	if(t != NULL && t->status.state == MESSAGE_PENDING)
+	{
+		if(success)
+			t->status.fragmentsSent++;
+		else
+			t->status.fragmentsFailed++;
+		
+		// one lost fragment makes the whole message useless, loop() drops the rest of it
+		if(!success || t->status.fragmentsSent >= t->status.fragments)
+		{
+			t->status.state = success ? MESSAGE_DELIVERED : MESSAGE_FAILED;
+			t->status.sendTime = now - t->queuedAt;
+			done = *t;
+			complete = true;
+		}
+	}
+	
+	EspNowUnlock(_lock);
+	
+	if(!complete)
+		return;
+	
+	trace(TRACE_COMPLETE, done.device, id, done.status.fragmentsSent, done.status.state);
+	
+	if(done.type == SimpleEspNowMessageType::SLOT)
+	{
+		int slot = peerDatabase.findPeer(done.device);
+		
+		// a sleeping client gets its slot again with the next CONNECT
+		if(slot >= 0 && done.status.state == MESSAGE_FAILED && 
+		   ++peerDatabase._state[slot].slotRetries < SlotMaxRetries)
+			peerDatabase._state[slot].slotPending = true;
+		
+		return;
+	}
+	
+	if(_MessageCompleteFunction != NULL)
+		_MessageCompleteFunction(done.device, done.status);
+}
+
+SimpleEspNowMessageStatus_t SimpleEspNowConnection::getMessageStatus(SimpleEspNowMessageHandle handle)
+{
+	SimpleEspNowMessageStatus_t status;
+	
+	EspNowLock(_lock);
+	
+	int i = findTracked(handle);
+	
+	if(i >= 0)
+		status = _tracked[i].status;
+	
+	EspNowUnlock(_lock);
+	
+	if(i >= 0)
+		return status;
+	
+	memset(&status, 0, sizeof(status));
+	status.handle = handle;
+	status.state = MESSAGE_UNKNOWN;	// never queued or already overwritten by newer messages
+	
+	return status;
+}
+
+SimpleEspNowMessageHandle SimpleEspNowConnection::sendMessage(char* message, String address)
+{
+	return sendMessage((uint8_t*)message, strlen(message)+1, address);
+}
+
+SimpleEspNowMessageHandle SimpleEspNowConnection::sendMessage(uint8_t* message, size_t len, String address)
+{
+	if(_role == SimpleEspNowRole::CLIENT)
+		return sendMessage(message, len, _serverMac);
+	
+	if(address.length() != 12)
+		return false;
+	
+	uint8_t *mac = strToMac(address.c_str());
+	
+	if(mac == NULL)
+		return false;
+	
+	SimpleEspNowMessageHandle ret = sendMessage(message, len, mac);
+	
+	delete[] mac;
+	
+	return ret;
+}
+
+SimpleEspNowMessageHandle SimpleEspNowConnection::sendMessage(uint8_t* message, size_t len, const uint8_t* mac)
+{
+	return queueMessage(SimpleEspNowMessageType::DATA, message, len, mac);
+}
+
+uint32_t SimpleEspNowConnection::queueMessage(uint8_t type, uint8_t* message, size_t len, const uint8_t* mac)
+{
+	if( mac == NULL ||
+		(_role == SimpleEspNowRole::CLIENT && _serverMac[0] == 0 ))
 	{
 		return false;
 	}
 
-	int packages = len / 235 + 1;
+	if(_role == SimpleEspNowRole::CLIENT)
+		mac = _serverMac;
+	
+	int packages = len == 0 ? 1 : (len + getFragmentSize(mac) - 1) / getFragmentSize(mac);
 
-	if(!_supportLooping && packages > 1)
+	if(!_supportLooping && (packages > 1 || type != SimpleEspNowMessageType::DATA))
 		return false;
 
 #ifdef DEBUG
@@ -494,235 +1419,2051 @@ bool SimpleEspNowConnection::sendMessage(uint8_t* message, size_t len, String ad
 #endif
 	
 	if(!_supportLooping)
-		return sendMessageOld(message, address);
-	
-	if(_role == SimpleEspNowRole::CLIENT)
-		address = macToStr(_serverMac);
+		return sendMessageOld(message, macToStr(mac)) ? 1 : 0; // sent directly, not tracked
 	
-	prepareSendPackages(message, len, address);
-	
-	return true;
+	return prepareSendPackages(message, len, mac, type);
 }
 
-bool SimpleEspNowConnection::sendPackage(long id, int package, int sum, uint8_t* message, size_t messagelen, uint8_t* address)
+bool SimpleEspNowConnection::sendPackage(long id, int package, int sum, uint8_t* message, size_t messagelen, uint8_t* address, uint8_t type)
 {
-	char sendMessage[messagelen+7];
+	int headerSize = EspNowHeaderSize;
+	uint8_t sendMessage[messagelen+EspNowHeaderSize+TimestampSize];
 
-	sendMessage[0] = SimpleEspNowMessageType::DATA;	// Type of message
+	sendMessage[0] = type;	// Type of message
 	sendMessage[1] = package;	
 	sendMessage[2] = sum;	
 	memcpy(sendMessage+3, &id, 4);	
-	memcpy(sendMessage+7, message, messagelen);	
+	
+	if(_sendTimestamps && isTimeSynced())
+	{
+		uint32_t now = getServerTime();
+		
+		sendMessage[0] |= TimestampFlag;
+		memcpy(sendMessage+EspNowHeaderSize, &now, TimestampSize);
+		headerSize += TimestampSize;
+	}
+	
+	memcpy(sendMessage+headerSize, message, messagelen);	
+	trace(TRACE_SEND, address, id, package, type);
 	
 	if(_role == SimpleEspNowRole::SERVER)
+	{
+		int slot = peerDatabase.findPeer(address);
+		
+		if(slot >= 0)
+		{
+			peerDatabase._peers[slot].txCount++;
+			peerDatabase.markDirty(slot, false);
+		}
+	}
+	
+	return sendRoutedFrame(address, sendMessage, messagelen+headerSize);
+}
+
+const uint8_t* SimpleEspNowConnection::getNextHop(const uint8_t* address, size_t len)
+{
+	const uint8_t *nextHop = NULL;
+	int route = findRoute(address);
+	
+	if(route >= 0)
+	{
+		nextHop = _routes[route].nextHop;
+		_routes[route].lastUsed = millis();
+	}
+	else if(_relayMacSet && memcmp(address, _serverMac, 6) == 0)
+		nextHop = _relayMac;
+	
+	if(len + RelayHeaderSize > EspNowMaxFrameSize)
+		return NULL;
+	
+	return nextHop;
+}
+
+size_t SimpleEspNowConnection::buildRelayFrame(uint8_t* relayMessage, const uint8_t* address, const uint8_t* frame, size_t len)
+{
+	relayMessage[0] = SimpleEspNowMessageType::RELAY;
+	relayMessage[1] = 0;	// hops so far
+	memcpy(relayMessage+2, _myAddress, 6);
+	memcpy(relayMessage+8, address, 6);
+	memcpy(relayMessage+RelayHeaderSize, frame, len);
+	
+	return len+RelayHeaderSize;
+}
+
+bool SimpleEspNowConnection::sendRoutedFrame(const uint8_t* address, const uint8_t* frame, size_t len)
+{
+	const uint8_t *nextHop = getNextHop(address, len);
+	
+	if(nextHop == NULL)
+		return sendFrame(address, frame, len);
+	
+	uint8_t relayMessage[len+RelayHeaderSize];
+	
+	return sendFrame(nextHop, relayMessage, buildRelayFrame(relayMessage, address, frame, len));
+}
+
+bool SimpleEspNowConnection::queueFrame(const uint8_t* address, const uint8_t* frame, size_t len)
+{
+	// control frames go through the send queue like messages, so only one
+	// context sends and every send callback belongs to the frame in flight
+	const uint8_t *nextHop = getNextHop(address, len);
+	bool ret;
+	
+	if(nextHop == NULL)
+		ret = deviceSendMessageBuffer.createRawBuffer(address, frame, len);
+	else
+	{
+		uint8_t relayMessage[len+RelayHeaderSize];
+		
+		ret = deviceSendMessageBuffer.createRawBuffer(nextHop, relayMessage, buildRelayFrame(relayMessage, address, frame, len));
+	}
+	
+	if(ret)
+		notifyTransmit();
+	
+	return ret;
+}
+
+void SimpleEspNowConnection::stampFrame(uint8_t* frame, size_t len)
+{
+	// clock values of queued control frames are taken when they leave the queue
+	if(frame[0] == SimpleEspNowMessageType::RELAY)
+	{
+		if(len <= RelayHeaderSize || memcmp(frame+2, _myAddress, 6) != 0) // forwarded for another node
+			return;
+		
+		frame += RelayHeaderSize;
+		len -= RelayHeaderSize;
+	}
+	
+	uint32_t now = millis();
+	
+	if(frame[0] == SimpleEspNowMessageType::TIMESYNC && len >= EspNowHeaderSize+13)
+		memcpy(frame + (frame[7] == 1 ? 8 : 16), &now, 4);	// t1 of a request, t3 of a reply
+	else if(frame[0] == SimpleEspNowMessageType::CONNECT && len >= 17)
+		memcpy(frame+13, &now, 4);
+}
+
+bool SimpleEspNowConnection::sendFrame(const uint8_t* address, const uint8_t* frame, size_t len)
+{
+	int result;
+	
+	// another context must not delete the peer between adding it and sending to it
+	for(bool claimed = false; !claimed; )
+	{
+		EspNowLock(_lock);
+		claimed = !_sending;
+		_sending = true;
+		EspNowUnlock(_lock);
+		
+		if(!claimed)
+			yield();
+	}
+	
+	_sendStatistics.framesSent++;
+	
+	if(_role == SimpleEspNowRole::SERVER || memcmp(address, _serverMac, 6) != 0)
 	{
 #if defined(ESP32)
 		memcpy(&simpleEspNowConnection->_clientMacPeerInfo.peer_addr, address, 6);
 		esp_now_add_peer(&simpleEspNowConnection->_clientMacPeerInfo);
 #elif defined(ESP8266)		
-		esp_now_add_peer(address, ESP_NOW_ROLE_COMBO, simpleEspNowConnection->_channel, NULL, 0);
+		esp_now_add_peer((uint8_t *)address, ESP_NOW_ROLE_COMBO, simpleEspNowConnection->_channel, NULL, 0);
 #endif
 		
-		esp_now_send(address, (uint8_t *) sendMessage, messagelen+7);		
+		// set first, the send callback can run on the other core before esp_now_send returns
 		_openTransaction = true;
+		result = esp_now_send((uint8_t *)address, (uint8_t *) frame, len);		
 
-		esp_now_del_peer(address);
+		esp_now_del_peer((uint8_t *)address);
 	}
 	else
 	{		
 		_openTransaction = true;
-		esp_now_send(address, (uint8_t *) sendMessage, messagelen+7);
+		result = esp_now_send((uint8_t *)address, (uint8_t *) frame, len);
+	}
+	
+	_sending = false;
+	
+	// a refused frame gets no send callback, it would keep the transaction open
+	if(result != 0)
+	{
+		sendDone(address, 1);
+		return false;
 	}
 		
 	return true;
 }
 
-bool SimpleEspNowConnection::sendMessageOld(uint8_t* message, String address)
+void SimpleEspNowConnection::sendDone(const uint8_t* mac, uint8_t sendStatus)
 {
-	if( (_role == SimpleEspNowRole::SERVER && address.length() != 12 ) ||
-		(_role == SimpleEspNowRole::CLIENT && _serverMac[0] == 0 ) ||
-		sizeof(message) > 235)
+	// taken before the transaction is closed, the next fragment can be sent right after that
+	long id = _inFlightId;
+	
+	_inFlightId = 0;
+	_lastSentTime = millis();
+	_openTransaction = false;
+	notifyTransmit();
+	
+	if(sendStatus != 0)
+		_sendStatistics.sendErrors++;
+	
+	trace(TRACE_SEND_DONE, mac, id, 0, sendStatus);
+	
+	if(id != 0)
+		completeFragment(id, sendStatus == 0);
+
+	if(memcmp(mac, _pairingMac, 6) != 0)
 	{
-		return false;
-	}
+		if(sendStatus != 0 && _SendErrorFunction != NULL)
+		{
+		  _SendErrorFunction((uint8_t*)mac);
+		}
+		if(sendStatus == 0 && _SendDoneFunction != NULL)
+		{
+		  _SendDoneFunction((uint8_t*)mac);
+		}	 
+	}		
+}
 
-	uint8_t sendMessage[sizeof(message)+7];
-	long id = millis();
+size_t SimpleEspNowConnection::getFrameSize(const uint8_t* mac)
+{
+	int slot = peerDatabase.findPeer(mac);
+	size_t size = slot >= 0 ? peerDatabase._peers[slot].frameSize : 0;
+	
+	if(size < EspNowMaxFrameSize)	// legacy or unknown peer
+		return EspNowMaxFrameSize;
+	
+	return size < EspNowLocalFrameSize ? size : EspNowLocalFrameSize;
+}
 
-	sendMessage[0] = SimpleEspNowMessageType::DATA;	// Type of message
-	sendMessage[1] = 1;	// 1st package
-	sendMessage[2] = 1;	// from 1 package. WIll be enhanced in one of the next versions
-	memcpy(sendMessage+3, &id, 4);		
-	memcpy(sendMessage+7, message, sizeof(message));
+void SimpleEspNowConnection::setPeerFrameSize(const uint8_t* mac, const uint8_t* advertised)
+{
+	int slot = peerDatabase.findPeer(mac);
+	uint16_t frameSize = 0;
+	
+	if(slot < 0)
+		return;
+	
+	if(advertised != NULL)
+		memcpy(&frameSize, advertised, 2);
+	
+	if(peerDatabase._peers[slot].frameSize != frameSize)
+	{
+		peerDatabase._peers[slot].frameSize = frameSize;
+		peerDatabase.markDirty(slot);
+	}
+}
 
-#if defined(ESP8266)
-	esp_now_register_send_cb([](uint8_t* mac, uint8_t sendStatus) 
-#elif defined(ESP32)		
-	esp_now_register_send_cb([] (const uint8_t *mac, esp_now_send_status_t sendStatus)
-#endif	
-	{//this is the function that is called to send data
-#ifdef DEBUG
-	  Serial.printf("send_cb, send done, status = %i\n", sendStatus);
-#endif	
-	  esp_now_unregister_send_cb();
+size_t SimpleEspNowConnection::getFragmentSize(const uint8_t* mac)
+{
+	size_t size = EspNowFragmentSize;
+	
+	// relay nodes may be legacy nodes, relayed frames keep the small size
+	if(_relayMacSet || _relayMode || findRoute(mac) >= 0)
+		size -= RelayHeaderSize;
+	else
+		size += getFrameSize(mac) - EspNowMaxFrameSize;
+	if(_sendTimestamps)
+		size -= TimestampSize;
+	
+	return size;
+}
 
-	  if(sendStatus != 0 && simpleEspNowConnection->_SendErrorFunction != NULL)
-	  {
-		  simpleEspNowConnection->_SendErrorFunction((uint8_t*)mac);
-	  }
-	  if(sendStatus == 0 && simpleEspNowConnection->_SendDoneFunction != NULL)
-	  {
-		  simpleEspNowConnection->_SendDoneFunction((uint8_t*)mac);
-	  }	  	  
-	});
+int SimpleEspNowConnection::findRoute(const uint8_t* dest)
+{
+    for(int i = 0; i<MaxRouteCount; i++)
+    {
+		if(_routes[i].used && memcmp(_routes[i].dest, dest, 6) == 0)
+			return i;
+	}
+	
+	return -1;
+}
 
+void SimpleEspNowConnection::learnRoute(const uint8_t* dest, const uint8_t* nextHop, uint8_t hops)
+{
+	int route = findRoute(dest);
 	
-	if(_role == SimpleEspNowRole::SERVER)
+	if(route >= 0 && hops > _routes[route].hops && memcmp(_routes[route].nextHop, nextHop, 6) != 0)
 	{
-		uint8_t *mac = strToMac(address.c_str());
+		_routes[route].lastUsed = millis(); // keep the shorter route
+		return;
+	}
+	
+	if(route < 0)
+	{
+		route = 0;
+		
+		// take a free entry or replace the least recently used one
+		for(int i = 0; i<MaxRouteCount; i++)
+		{
+			if(!_routes[i].used)
+			{
+				route = i;
+				break;
+			}
+			if(_routes[i].lastUsed < _routes[route].lastUsed)
+				route = i;
+		}
+	}
+	
+	memcpy(_routes[route].dest, dest, 6);
+	memcpy(_routes[route].nextHop, nextHop, 6);
+	_routes[route].hops = hops;
+	_routes[route].used = true;
+	_routes[route].lastUsed = millis();
+}
 
-#if defined(ESP32)
-		memcpy(&simpleEspNowConnection->_clientMacPeerInfo.peer_addr, mac, 6);
-		esp_now_add_peer(&simpleEspNowConnection->_clientMacPeerInfo);
-#endif
-		esp_now_send(mac, (uint8_t *) sendMessage, sizeof(sendMessage));
-#if defined(ESP32)
-		esp_now_del_peer(mac);
-#endif
+void SimpleEspNowConnection::removeRoute(const uint8_t* dest)
+{
+	int route = findRoute(dest);
+	
+	if(route >= 0)
+		_routes[route].used = false;
+}
 
-		delete mac;
+bool SimpleEspNowConnection::isRelayDuplicate(const uint8_t* origin, const uint8_t* inner)
+{
+	long id;
+	
+	memcpy(&id, inner+3, 4);
+	
+    for(int i = 0; i<RelayHistorySize; i++)
+    {
+		if(_relayHistory[i].id == id && _relayHistory[i].package == inner[1] && 
+		   memcmp(_relayHistory[i].origin, origin, 6) == 0)
+			return true;
 	}
-	else
-	{		
-		esp_now_send(_serverMac, (uint8_t *) sendMessage, sizeof(sendMessage));
+	
+	memcpy(_relayHistory[_relayHistoryPos].origin, origin, 6);
+	_relayHistory[_relayHistoryPos].package = inner[1];
+	_relayHistory[_relayHistoryPos].id = id;
+	_relayHistoryPos = (_relayHistoryPos + 1) % RelayHistorySize;
+	
+	return false;
+}
+
+void SimpleEspNowConnection::handleRelayFrame(const uint8_t *mac, const uint8_t *data, int len)
+{
+	if(len <= RelayHeaderSize + EspNowHeaderSize)
+		return;
+	
+	const uint8_t *origin = data+2;
+	const uint8_t *dest = data+8;
+	uint8_t hops = data[1];
+	
+	if(memcmp(origin, _myAddress, 6) == 0)
+		return;
+	
+	if(memcmp(dest, _myAddress, 6) == 0)
+	{
+		if(memcmp(origin, mac, 6) != 0)
+			learnRoute(origin, mac, hops+1);
+		
+		processFrame(origin, data+RelayHeaderSize, len-RelayHeaderSize);
+		
+		return;
+	}
+	
+	if(!_relayMode || hops+1 >= _relayHopLimit || isRelayDuplicate(origin, data+RelayHeaderSize))
+		return;
+	
+	learnRoute(origin, mac, hops+1);
+	
+	const uint8_t *nextHop = dest;
+	int route = findRoute(dest);
+	
+	if(route >= 0)
+		nextHop = _routes[route].nextHop;
+	else if(_relayMacSet && memcmp(dest, _serverMac, 6) == 0)
+		nextHop = _relayMac;
+	
+	if(memcmp(nextHop, mac, 6) == 0) // never send it back
+		return;
+	
+	// forward the single fragment, nothing is reassembled on the relay
+	uint8_t frame[len];
+	
+	memcpy(frame, data, len);
+	frame[1] = hops+1;
+	
+	if(deviceSendMessageBuffer.createRawBuffer(nextHop, frame, len))
+		notifyTransmit();
+	
+#ifdef DEBUG
+	Serial.println("SimpleEspNowConnection::relay fragment from "+macToStr(origin)+" to "+macToStr(dest)+" via "+macToStr(nextHop));
+#endif
+}
+
+bool SimpleEspNowConnection::setRelayMode(bool enable, uint8_t hopLimit)
+{
+	if(hopLimit == 0)
+		return false;
+	
+	_relayMode = enable;
+	_relayHopLimit = hopLimit;
+	
+	return true;
+}
+
+bool SimpleEspNowConnection::setRelayMac(uint8_t* mac)
+{
+	if(mac == NULL)
+	{
+		_relayMacSet = false;
+		return true;
+	}
+	
+	memcpy(_relayMac, mac, 6);
+	_relayMacSet = true;
+	
+	return true;
+}
+
+bool SimpleEspNowConnection::setRelayMac(String address)
+{
+	if(address.length() == 0)
+		return setRelayMac((uint8_t *)NULL);
+	
+	uint8_t *mac = strToMac(address.c_str());
+
+	if(mac == NULL)
+		return false;
+	
+	setRelayMac(mac);
+	
+	delete[] mac;
+	
+	return true;
+}
+
+uint32_t SimpleEspNowConnection::getDuplicateCount(const uint8_t* mac)
+{
+	if(mac == NULL)
+		return peerDatabase._duplicates;
+	
+	int slot = peerDatabase.findPeer(mac);
+	
+	return slot < 0 ? 0 : peerDatabase._state[slot].duplicates;
+}
+
+bool SimpleEspNowConnection::clearRoutes()
+{
+    for(int i = 0; i<MaxRouteCount; i++)
+		_routes[i].used = false;
+	
+	return true;
+}
+
+bool SimpleEspNowConnection::sendMessageOld(uint8_t* message, String address)
+{
+	if( (_role == SimpleEspNowRole::SERVER && address.length() != 12 ) ||
+		(_role == SimpleEspNowRole::CLIENT && _serverMac[0] == 0 ) ||
+		sizeof(message) > 235)
+	{
+		return false;
+	}
+
+	uint8_t sendMessage[sizeof(message)+7];
+	long id = millis();
+
+	sendMessage[0] = SimpleEspNowMessageType::DATA;	// Type of message
+	sendMessage[1] = 1;	// 1st package
+	sendMessage[2] = 1;	// from 1 package. WIll be enhanced in one of the next versions
+	memcpy(sendMessage+3, &id, 4);		
+	memcpy(sendMessage+7, message, sizeof(message));
+
+#if defined(ESP8266)
+	esp_now_register_send_cb([](uint8_t* mac, uint8_t sendStatus) 
+#elif defined(EspNowSendInfo)
+	esp_now_register_send_cb([] (const wifi_tx_info_t *info, esp_now_send_status_t sendStatus)
+#elif defined(ESP32)		
+	esp_now_register_send_cb([] (const uint8_t *mac, esp_now_send_status_t sendStatus)
+#endif	
+	{//this is the function that is called to send data
+#if defined(EspNowSendInfo)
+		const uint8_t *mac = info->des_addr;
+#endif
+#ifdef DEBUG
+	  Serial.printf("send_cb, send done, status = %i\n", sendStatus);
+#endif	
+	  esp_now_unregister_send_cb();
+
+	  if(sendStatus != 0 && simpleEspNowConnection->_SendErrorFunction != NULL)
+	  {
+		  simpleEspNowConnection->_SendErrorFunction((uint8_t*)mac);
+	  }
+	  if(sendStatus == 0 && simpleEspNowConnection->_SendDoneFunction != NULL)
+	  {
+		  simpleEspNowConnection->_SendDoneFunction((uint8_t*)mac);
+	  }	  	  
+	});
+
+	
+	if(_role == SimpleEspNowRole::SERVER)
+	{
+		uint8_t *mac = strToMac(address.c_str());
+
+#if defined(ESP32)
+		memcpy(&simpleEspNowConnection->_clientMacPeerInfo.peer_addr, mac, 6);
+		esp_now_add_peer(&simpleEspNowConnection->_clientMacPeerInfo);
+#endif
+		esp_now_send(mac, (uint8_t *) sendMessage, sizeof(sendMessage));
+#if defined(ESP32)
+		esp_now_del_peer(mac);
+#endif
+
+		delete mac;
+	}
+	else
+	{		
+		esp_now_send(_serverMac, (uint8_t *) sendMessage, sizeof(sendMessage));
+	}
+	
+	return true;
+}
+uint8_t* SimpleEspNowConnection::strToMac(const char* str)
+{
+	if(strlen(str) != 12)
+		return NULL;
+	
+	uint8_t* mac = new uint8_t[6];
+	
+	char buffer[3];
+	buffer[2] = 0;
+	
+	for(int i = 0; i<6; i++)
+	{
+		strncpy ( buffer, str+i*2, 2 );
+		
+		mac[i] = strtol(buffer, NULL, 16);
+	}
+	
+	return mac;
+}
+
+String SimpleEspNowConnection::macToStr(const uint8_t* mac)
+{
+	char macAddr[13];
+	macAddr[12] = 0;
+	
+	sprintf(macAddr, "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);		
+
+	return String(macAddr);
+}
+
+
+#if defined(ESP8266)
+void SimpleEspNowConnection::onReceiveData(uint8_t *mac, uint8_t *data, uint8_t len) 
+#elif defined(EspNowRecvInfo)
+void SimpleEspNowConnection::onReceiveData(const esp_now_recv_info_t *info, const uint8_t *data, int len)
+#elif defined(ESP32)
+void SimpleEspNowConnection::onReceiveData(const uint8_t *mac, const uint8_t *data, int len)
+#endif
+{
+#if defined(EspNowRecvInfo)
+	const uint8_t *mac = info->src_addr;
+#endif
+
+	if(len > EspNowHeaderSize)
+	{
+		long id;
+		
+		memcpy(&id, data+3, 4);
+		simpleEspNowConnection->trace(TRACE_RECEIVE, mac, data[0] == SimpleEspNowMessageType::RELAY ? 0 : id, data[1], data[0]);
+	}
+	
+	if(len > 0 && data[0] != SimpleEspNowMessageType::RELAY)
+		simpleEspNowConnection->removeRoute(mac); // peer is in range again
+	
+	processFrame(mac, data, len);
+}
+
+void SimpleEspNowConnection::processFrame(const uint8_t *mac, const uint8_t *data, int len)
+{
+	if(len <= 7)
+		return;
+	
+	if(data[0] == SimpleEspNowMessageType::RELAY)
+	{
+		// a pairing client listens on the pairing address and must not forward
+		if(simpleEspNowConnection->_role == SimpleEspNowRole::SERVER ||
+		   !simpleEspNowConnection->_pairingOngoing)
+			simpleEspNowConnection->handleRelayFrame(mac, data, len);
+		
+		return;
+	}
+	
+	uint8_t type = data[0] & ~TimestampFlag;
+	int headerSize = EspNowHeaderSize;
+	long id;
+	int slot = simpleEspNowConnection->peerDatabase.findPeer(mac);
+	
+	memcpy(&id, data+3, 4);
+	
+	if(data[0] & TimestampFlag)
+	{
+		if(len < EspNowHeaderSize + TimestampSize)
+			return;
+		
+		headerSize += TimestampSize;
+		
+		uint32_t sent;
+		
+		memcpy(&sent, data+EspNowHeaderSize, TimestampSize);
+		
+		// sender and receiver both stamp in server time
+		if(slot >= 0 && (simpleEspNowConnection->_role == SimpleEspNowRole::SERVER || simpleEspNowConnection->_timeSynced))
+			simpleEspNowConnection->peerDatabase.addLatency(slot, (int32_t)(simpleEspNowConnection->getServerTime() - sent));
+	}
+	
+	bool isMessage = type == SimpleEspNowMessageType::DATA || 
+					 type == SimpleEspNowMessageType::REQUEST ||
+					 type == SimpleEspNowMessageType::RESPONSE ||
+					 type == SimpleEspNowMessageType::SUBSCRIBE ||
+					 type == SimpleEspNowMessageType::PUBLISH ||
+					 type == SimpleEspNowMessageType::OTA;
+	
+	// drop duplicates before any copy or reassembly work
+	if(isMessage && (simpleEspNowConnection->_role == SimpleEspNowRole::SERVER ||
+					 !simpleEspNowConnection->_pairingOngoing))
+	{
+		if( (slot >= 0 && simpleEspNowConnection->peerDatabase.isDuplicate(slot, id)) ||
+			(data[2] > 1 && simpleEspNowConnection->deviceReceiveMessageBuffer.hasFragment(mac, id, data[1]-1)) )
+		{
+			simpleEspNowConnection->peerDatabase.countDuplicate(slot);
+			simpleEspNowConnection->trace(TRACE_DUPLICATE, mac, id, data[1], type);
+#ifdef DEBUG
+			Serial.printf("Duplicate package %d of %d packages dropped\n", data[1], data[2]);
+#endif			
+			return;
+		}
+	}
+	
+	int bufferLen = len - headerSize;
+	uint8_t buffer[bufferLen+1];
+	buffer[bufferLen] = 0;
+	
+	memcpy(buffer, data+headerSize, bufferLen);
+	
+	if(simpleEspNowConnection->_role == SimpleEspNowRole::CLIENT &&
+		simpleEspNowConnection->_pairingOngoing)
+	{
+		if(type == SimpleEspNowMessageType::PAIR)			
+		{
+			if(simpleEspNowConnection->_NewGatewayAddressFunction)
+			{
+#if defined(ESP8266)
+				wifi_set_macaddr(STATION_IF, &simpleEspNowConnection->_myAddress[0]);
+#elif defined(ESP32)
+				esp_wifi_set_mac(WIFI_IF_STA, &simpleEspNowConnection->_myAddress[0]);
+#endif				
+				simpleEspNowConnection->endPairing();
+				simpleEspNowConnection->_NewGatewayAddressFunction((uint8_t *)mac, String(simpleEspNowConnection->macToStr((uint8_t *)mac)));
+				
+				if(bufferLen >= 8) // the server is known now if setServerMac was called
+					simpleEspNowConnection->setPeerFrameSize(mac, buffer+6);
+				
+				memcpy(simpleEspNowConnection->_pairingReplyMac, mac, 6);
+				
+				// many clients hear the same beacon, spread the replies to avoid collisions
+				if(simpleEspNowConnection->_pairingReplyJitter > 0)
+					simpleEspNowConnection->_pairingTicker.once_ms(random(1, simpleEspNowConnection->_pairingReplyJitter+1), SimpleEspNowConnection::pairingReplyClient);
+				else
+					pairingReplyClient();
+			}
+		}
+	}
+	else
+	{
+		if(simpleEspNowConnection->_role == SimpleEspNowRole::SERVER)
+		{
+			if(slot < 0 && (type == SimpleEspNowMessageType::PAIR || type == SimpleEspNowMessageType::CONNECT))
+				slot = simpleEspNowConnection->peerDatabase.addPeer(mac);
+			if(slot >= 0)
+				simpleEspNowConnection->peerDatabase.touchPeer(slot);
+			
+			if(type == SimpleEspNowMessageType::PAIR && bufferLen >= 8)
+				simpleEspNowConnection->setPeerFrameSize(mac, buffer+6);
+			if(type == SimpleEspNowMessageType::CONNECT)	// legacy clients do not advertise a size
+				simpleEspNowConnection->setPeerFrameSize(mac, bufferLen >= 12 ? buffer+10 : NULL);
+			if(type == SimpleEspNowMessageType::CONNECT && slot >= 0)	// the client subscribes again
+			{
+				simpleEspNowConnection->clearSubscriptions(slot);
+				simpleEspNowConnection->peerDatabase._state[slot].subscriptionQueries = SubscriptionsKnown;
+			}
+			else if(slot >= 0 && type != SimpleEspNowMessageType::PAIR && type != SimpleEspNowMessageType::SUBSCRIBE)
+				simpleEspNowConnection->querySubscriptions(slot);
+		}
+		
+		if(isMessage)
+		{
+#ifdef DEBUG
+			Serial.printf("Package %d of %d packages\n", data[1], data[2]);
+#endif			
+
+			if(data[1] == 1 && data[2] > 1)  // prepare memory for this device
+			{
+				simpleEspNowConnection->deviceReceiveMessageBuffer.createBuffer(mac, id, data[2]);				
+				simpleEspNowConnection->deviceReceiveMessageBuffer.addBuffer(mac, id, (uint8_t *)buffer, bufferLen, data[1]-1);
+			}
+			else if(data[2] > 1)
+			{
+				simpleEspNowConnection->deviceReceiveMessageBuffer.addBuffer(mac, id, (uint8_t *)buffer, bufferLen, data[1]-1);
+			}
+
+			if(data[1] == data[2])
+			{
+				if(data[2] > 1)
+				{
+					// a message with missing fragments is dropped instead of delivered incomplete
+					if(simpleEspNowConnection->deviceReceiveMessageBuffer.isComplete(mac, id, data[2]))
+					{
+						size_t blen = simpleEspNowConnection->deviceReceiveMessageBuffer.getBufferSize(mac, id, data[2]);
+						uint8_t *bb = simpleEspNowConnection->deviceReceiveMessageBuffer.getBuffer(mac, id, data[2], blen);
+						
+						if(slot >= 0)
+							simpleEspNowConnection->peerDatabase.markReceived(slot, id);
+						
+						simpleEspNowConnection->trace(TRACE_DELIVER, mac, id, data[2], type);
+						simpleEspNowConnection->deliverMessage(type, mac, bb, blen);
+						delete[] bb;
+					}
+					else
+						simpleEspNowConnection->trace(TRACE_INCOMPLETE, mac, id, data[2], type);
+					simpleEspNowConnection->deviceReceiveMessageBuffer.deleteBuffer(mac, id);
+				}
+				else
+				{
+					if(slot >= 0)
+						simpleEspNowConnection->peerDatabase.markReceived(slot, id);
+					
+					simpleEspNowConnection->trace(TRACE_DELIVER, mac, id, 1, type);
+					simpleEspNowConnection->deliverMessage(type, mac, buffer, bufferLen);
+				}
+			}
+		}
+		if(type == SimpleEspNowMessageType::TIMESYNC)
+		{
+			simpleEspNowConnection->handleTimeSync(mac, buffer, bufferLen);
+		}
+		if(type == SimpleEspNowMessageType::SLOT)
+		{
+			simpleEspNowConnection->handleSlotAssignment(mac, buffer, bufferLen);
+		}
+		if(type == SimpleEspNowMessageType::CONNECT && 
+		   simpleEspNowConnection->_role == SimpleEspNowRole::SERVER && bufferLen >= 6+4)
+		{
+			uint32_t t1;
+			
+			memcpy(&t1, buffer+6, 4); // client time piggybacked on CONNECT
+			simpleEspNowConnection->sendTimeSync(mac, 2, t1, millis());
+		}
+		if(type == SimpleEspNowMessageType::CONNECT && 
+		   simpleEspNowConnection->_role == SimpleEspNowRole::SERVER && simpleEspNowConnection->_slotCount > 0 && slot >= 0)
+		{
+			simpleEspNowConnection->peerDatabase._state[slot].slotRetries = 0;
+			simpleEspNowConnection->peerDatabase._state[slot].slotPending = true;	// sent by loop()
+		}
+		if(type == SimpleEspNowMessageType::PAIR && 
+			simpleEspNowConnection->_role == SimpleEspNowRole::SERVER &&
+			simpleEspNowConnection->_pairingOngoing)
+		{
+			unsigned long latency = millis() - simpleEspNowConnection->_pairingStartTime;
+			int bucket = 0;
+			
+			while(bucket < PairingHistogramBuckets-1 && latency >= (250UL << bucket))
+				bucket++;
+			
+			simpleEspNowConnection->_pairingStatistics.latencyHistogram[bucket]++;
+			simpleEspNowConnection->_pairingStatistics.pairedClients++;
+		}
+		if(simpleEspNowConnection->_PairedFunction)
+		{		
+			if(type == SimpleEspNowMessageType::PAIR)			
+				simpleEspNowConnection->_PairedFunction((uint8_t *)mac, String(simpleEspNowConnection->macToStr((uint8_t *)buffer)));			
+		}
+		if(simpleEspNowConnection->_ConnectedFunction)
+		{
+			if(type == SimpleEspNowMessageType::CONNECT)
+				simpleEspNowConnection->_ConnectedFunction((uint8_t *)mac, String(simpleEspNowConnection->macToStr((uint8_t *)buffer)));							
+		}
+		
+#ifdef DEBUG
+		Serial.println("SimpleEspNowConnection::message arrived from : "+simpleEspNowConnection->macToStr((uint8_t *)mac));
+#endif	
+	}
+}
+
+bool SimpleEspNowConnection::sendTimeSync(const uint8_t *mac, uint8_t mode, uint32_t t1, uint32_t t2)
+{
+	uint8_t sendMessage[EspNowHeaderSize+15];
+	long ids = millis();
+	uint32_t t3 = millis();
+	uint16_t frameSize = EspNowLocalFrameSize;
+	
+	sendMessage[0] = SimpleEspNowMessageType::TIMESYNC;
+	sendMessage[1] = 1;
+	sendMessage[2] = 1;
+	memcpy(sendMessage+3, &ids, 4);	
+	sendMessage[7] = mode;	// 1 = request, 2 = reply
+	memcpy(sendMessage+8, &t1, 4);	
+	memcpy(sendMessage+12, &t2, 4);	
+	memcpy(sendMessage+16, &t3, 4);	
+	memcpy(sendMessage+20, &frameSize, 2);	// lets the client use large frames after CONNECT
+	
+	return queueFrame(mac, sendMessage, sizeof(sendMessage));
+}
+
+void SimpleEspNowConnection::handleTimeSync(const uint8_t *mac, const uint8_t *message, size_t len)
+{
+	if(len < 13)
+		return;
+	
+	uint32_t t1, t2, t3, t4 = millis();
+	
+	memcpy(&t1, message+1, 4);
+	memcpy(&t2, message+5, 4);
+	memcpy(&t3, message+9, 4);
+	
+	if(message[0] == 1 && _role == SimpleEspNowRole::SERVER)
+	{
+		sendTimeSync(mac, 2, t1, t4);
+		return;
+	}
+	
+	if(message[0] != 2 || _role != SimpleEspNowRole::CLIENT || memcmp(mac, _serverMac, 6) != 0)
+		return;
+	
+	if(len >= 15)
+		setPeerFrameSize(mac, message+13);
+	
+	uint32_t rtt = (t4 - t1) - (t3 - t2);
+	
+	// samples with a long round trip are less accurate, skip them if we have a good one
+	if(_timeSynced && rtt > 2 * _roundTripTime + 2 && t4 - _lastTimeSync < 10 * _timeSyncInterval)
+		return;
+	
+	int32_t d1 = (int32_t)(t2 - t1);
+	int32_t d2 = (int32_t)(t3 - t4);
+	int32_t offset = d1 + (d2 - d1) / 2;
+	
+	if(_timeSynced && t4 - _lastTimeSync >= 10000)
+	{
+		float skew = (float)(offset - _clockOffset) * 1000000.0 / (float)(t4 - _lastTimeSync);
+		
+		_clockSkew = _clockSkew == 0 ? skew : _clockSkew * 0.75 + skew * 0.25;
+	}
+	
+	_clockOffset = offset;
+	_roundTripTime = rtt;
+	_lastTimeSync = t4;
+	_timeSynced = true;
+	
+#ifdef DEBUG
+	Serial.printf("SimpleEspNowConnection::time sync offset %d ms, rtt %u ms, skew %f ppm\n", offset, rtt, _clockSkew);
+#endif	
+}
+
+bool SimpleEspNowConnection::syncTime()
+{
+	if(_role != SimpleEspNowRole::CLIENT || _serverMac[0] == 0)
+		return false;
+	
+	_lastTimeSyncRequest = millis();
+	
+	return sendTimeSync(_serverMac, 1, millis(), 0);
+}
+
+bool SimpleEspNowConnection::setTimeSyncInterval(unsigned long intervalMs)
+{
+	_timeSyncInterval = intervalMs;
+	
+	return true;
+}
+
+bool SimpleEspNowConnection::isTimeSynced()
+{
+	return _role == SimpleEspNowRole::SERVER || _timeSynced;
+}
+
+uint32_t SimpleEspNowConnection::getServerTime()
+{
+	unsigned long now = millis();
+	
+	if(_role == SimpleEspNowRole::SERVER)
+		return now;
+	
+	return now + _clockOffset + (int32_t)(_clockSkew * (float)(now - _lastTimeSync) / 1000000.0);
+}
+
+int32_t SimpleEspNowConnection::getClockOffset()
+{
+	return _clockOffset;
+}
+
+float SimpleEspNowConnection::getClockSkew()
+{
+	return _clockSkew;
+}
+
+uint32_t SimpleEspNowConnection::getRoundTripTime()
+{
+	return _roundTripTime;
+}
+
+bool SimpleEspNowConnection::setSendTimestamps(bool enable)
+{
+	_sendTimestamps = enable;
+	
+	return true;
+}
+
+bool SimpleEspNowConnection::setSlottedMode(uint16_t frameMs, uint16_t slotMs)
+{
+	if(_role != SimpleEspNowRole::SERVER || (frameMs > 0 && (slotMs <= SlotGuardTime || slotMs > frameMs)))
+		return false;
+	
+	_slotFrame = frameMs;
+	_slotLength = frameMs > 0 ? slotMs : 0;
+	_slotCount = frameMs > 0 ? frameMs / slotMs : 0;
+	_nextTxSlot = 0;
+	
+	// hand out the new schedule to all known clients, loop() sends it in
+	// batches as the send buffer has room
+    for(int i = 0; i<MaxPeerCount; i++)
+    {
+		peerDatabase._state[i].txSlot = 0;
+		peerDatabase._state[i].slotRetries = 0;
+		peerDatabase._state[i].slotPending = peerDatabase._peers[i].flags == PeerUsed;
+	}
+	
+	sendSlotAssignments();
+	
+	return true;
+}
+
+void SimpleEspNowConnection::sendSlotAssignments()
+{
+	// half of the send buffer stays free for application messages
+    for(int i = 0; i<MaxPeerCount && deviceSendMessageBuffer.getFreeCount() > MaxBufferSize/2; i++)
+    {
+		if(peerDatabase._peers[i].flags != PeerUsed || !peerDatabase._state[i].slotPending)
+			continue;
+		
+		peerDatabase._state[i].slotPending = false;
+		
+		if(!sendSlotAssignment(i))
+		{
+			peerDatabase._state[i].slotPending = true;
+			break;
+		}
+	}
+}
+
+bool SimpleEspNowConnection::sendSlotAssignment(int slot)
+{
+	uint16_t txSlot = 0;
+	
+	if(_slotCount > 0)
+	{
+		// clients keep their slot on reconnect, more clients than slots share them
+		if(peerDatabase._state[slot].txSlot == 0)
+		{
+			peerDatabase._state[slot].txSlot = _nextTxSlot + 1;
+			_nextTxSlot = (_nextTxSlot + 1) % _slotCount;
+		}
+		
+		txSlot = peerDatabase._state[slot].txSlot - 1;
+	}
+	
+	uint8_t message[8];
+	
+	memcpy(message, &txSlot, 2);
+	memcpy(message+2, &_slotCount, 2);	// 0 switches the slotted mode off
+	memcpy(message+4, &_slotLength, 2);
+	memcpy(message+6, &_slotFrame, 2);
+	
+	return queueMessage(SimpleEspNowMessageType::SLOT, message, sizeof(message), peerDatabase._peers[slot].mac);
+}
+
+void SimpleEspNowConnection::handleSlotAssignment(const uint8_t *mac, const uint8_t *message, size_t len)
+{
+	if(len < 8 || _role != SimpleEspNowRole::CLIENT || memcmp(mac, _serverMac, 6) != 0)
+		return;
+	
+	uint16_t txSlot;
+	
+	memcpy(&txSlot, message, 2);
+	memcpy(&_slotCount, message+2, 2);
+	memcpy(&_slotLength, message+4, 2);
+	memcpy(&_slotFrame, message+6, 2);
+	
+	_txSlot = _slotCount > 0 ? txSlot : -1;
+	
+#ifdef DEBUG
+	Serial.printf("SimpleEspNowConnection::transmit slot %d of %d, %d ms every %d ms\n", _txSlot, _slotCount, _slotLength, _slotFrame);
+#endif	
+}
+
+bool SimpleEspNowConnection::isInTransmitSlot()
+{
+	// without a synchronized clock the slot position is unknown, send at once
+	if(_role != SimpleEspNowRole::CLIENT || _txSlot < 0 || !_timeSynced)
+		return true;
+	
+	uint32_t pos = getServerTime() % _slotFrame;
+	uint32_t start = (uint32_t)_txSlot * _slotLength;
+	
+	return pos >= start && pos < start + _slotLength - SlotGuardTime;
+}
+
+int SimpleEspNowConnection::getTransmitSlot()
+{
+	return _txSlot;
+}
+
+bool SimpleEspNowConnection::setPeerQueueLimit(int fragments)
+{
+	if(fragments < 1 || fragments > MaxBufferSize)
+		return false;
+	
+	deviceSendMessageBuffer._queueLimit = fragments;
+	
+	return true;
+}
+
+SimpleEspNowQueueStatistics_t SimpleEspNowConnection::getQueueStatistics(const uint8_t* mac)
+{
+	SimpleEspNowQueueStatistics_t stats;
+	int slot = peerDatabase.findPeer(mac);
+	
+	if(slot < 0)
+		memset(&stats, 0, sizeof(stats));
+	else
+		stats = peerDatabase._state[slot].queue;
+	
+	stats.queued = deviceSendMessageBuffer.getQueuedCount(mac);
+	
+	return stats;
+}
+
+void SimpleEspNowConnection::trace(uint8_t event, const uint8_t *mac, long id, uint8_t fragment, uint8_t status)
+{
+	int slot = mac != NULL ? peerDatabase.findPeer(mac) : -1;
+	uint32_t now = micros();
+	
+	EspNowLock(_lock);
+	
+	SimpleEspNowTraceRecord_t *r = &_trace[_tracePos++ & (TraceBufferSize-1)];
+	
+	r->time = now;
+	r->event = event;
+	r->peer = slot >= 0 ? slot : 0xFF;
+	r->fragment = fragment;
+	r->status = status;
+	r->id = id;
+	
+	EspNowUnlock(_lock);
+}
+
+int SimpleEspNowConnection::getTrace(SimpleEspNowTraceRecord_t* records, int maxRecords)
+{
+	EspNowLock(_lock);
+	
+	uint32_t end = _tracePos;
+	uint32_t count = end < TraceBufferSize ? end : TraceBufferSize;
+	
+	if(count > (uint32_t)maxRecords)
+		count = maxRecords;
+	
+	// oldest record first
+	for(uint32_t i = 0; i<count; i++)
+		records[i] = _trace[(end - count + i) & (TraceBufferSize-1)];
+	
+	EspNowUnlock(_lock);
+	
+	return count;
+}
+
+void SimpleEspNowConnection::dumpTrace(Print& out)
+{
+	SimpleEspNowTraceRecord_t records[TraceBufferSize];
+	int count = getTrace(records, TraceBufferSize);
+	bool peers[MaxPeerCount];
+	
+	memset(peers, 0, sizeof(peers));
+	
+	// text lines survive the serial monitor, extras/trace_decode.py reads them back
+	out.printf("#TRACE BEGIN %s %d %lu\n", myAddress.c_str(), count, (unsigned long)micros());
+	
+	for(int i = 0; i<count; i++)
+	{
+		const uint8_t *b = (const uint8_t *)&records[i];
+		
+		for(int n = 0; n<(int)sizeof(SimpleEspNowTraceRecord_t); n++)
+			out.printf("%02X", b[n]);
+		out.printf("\n");
+		
+		if(records[i].peer != 0xFF)
+			peers[records[i].peer] = true;
+	}
+	
+	for(int i = 0; i<MaxPeerCount; i++)
+	{
+		if(peers[i])
+			out.printf("#PEER %d %s\n", i, macToStr(peerDatabase._peers[i].mac).c_str());
+	}
+	
+	out.printf("#TRACE END\n");
+}
+
+void SimpleEspNowConnection::clearTrace()
+{
+	EspNowLock(_lock);
+	_tracePos = 0;
+	EspNowUnlock(_lock);
+}
+
+SimpleEspNowSendStatistics_t SimpleEspNowConnection::getSendStatistics()
+{
+	return _sendStatistics;
+}
+
+SimpleEspNowLatencyStatistics_t SimpleEspNowConnection::getLatencyStatistics(const uint8_t* mac)
+{
+	SimpleEspNowLatencyStatistics_t stats;
+	int slot = peerDatabase.findPeer(mac);
+	
+	if(slot < 0)
+		memset(&stats, 0, sizeof(stats));
+	else
+		stats = peerDatabase._state[slot].latency;
+	
+	return stats;
+}
+
+void SimpleEspNowConnection::deliverMessage(uint8_t type, const uint8_t *mac, const uint8_t *message, size_t len)
+{
+	if(type == SimpleEspNowMessageType::DATA)
+	{
+		if(_MessageFunction)
+			_MessageFunction((uint8_t *)mac, message, len);
+		
+		return;
+	}
+	
+	if(type == SimpleEspNowMessageType::SUBSCRIBE)
+	{
+		handleSubscribe(mac, message, len);
+		return;
+	}
+	
+	if(type == SimpleEspNowMessageType::OTA)
+	{
+		handleOta(mac, message, len);
+		return;
+	}
+	
+	if(len < 2)
+		return;
+	
+	if(type == SimpleEspNowMessageType::PUBLISH)
+	{
+		uint16_t topic;
+		
+		memcpy(&topic, message, 2);
+		
+		if(_PublishFunction)
+			_PublishFunction((uint8_t *)mac, topic, message+2, len-2);
+		
+		return;
+	}
+	
+	uint16_t requestId;
+	
+	memcpy(&requestId, message, 2);
+	
+	if(type == SimpleEspNowMessageType::REQUEST)
+	{
+		if(_RequestFunction)
+			_RequestFunction((uint8_t *)mac, requestId, message+2, len-2);
+		
+		return;
+	}
+	
+	// the low byte of the id is the index of the pending request
+	int index = requestId & 0xFF;
+	
+	ResponseFunction fn;
+	bool claimed = false;
+	
+	// claimed under the lock, so the timeout sweep in loop() cannot call it a second time
+	EspNowLock(_lock);
+	if(index < MaxPendingRequests && _requests[index].used && 
+	   _requests[index].generation == (requestId >> 8) &&
+	   memcmp(_requests[index].peer, mac, 6) == 0)
+	{
+		_requests[index].used = false;
+		fn.swap(_requests[index].callback);
+		claimed = true;
+	}
+	EspNowUnlock(_lock);
+	
+	if(!claimed)
+	{
+#ifdef DEBUG
+		Serial.printf("SimpleEspNowConnection::unexpected response %04X\n", requestId);
+#endif	
+		return;
+	}
+	
+	if(fn)
+		fn((uint8_t *)mac, requestId, SimpleEspNowRequestResult::REQUEST_OK, message+2, len-2);
+}
+
+#define SubscribeRemove 0
+#define SubscribeAdd 1
+#define SubscribeQuery 2	// the server asks for the complete list
+#define SubscribeList 3		// complete list, replaces the known subscriptions
+
+int SimpleEspNowConnection::findTopic(uint16_t topic, bool create)
+{
+	int free = -1;
+	
+    for(int i = 0; i<MaxTopicCount; i++)
+	{
+		if(_topics[i].used && _topics[i].topic == topic)
+			return i;
+		if(!_topics[i].used && free < 0)
+			free = i;
+	}
+	
+	if(!create || free < 0)
+		return -1;
+	
+	memset(&_topics[free], 0, sizeof(TopicEntry_t));
+	_topics[free].topic = topic;
+	_topics[free].used = true;
+	
+	return free;
+}
+
+void SimpleEspNowConnection::handleSubscribe(const uint8_t *mac, const uint8_t *message, size_t len)
+{
+	int slot = peerDatabase.findPeer(mac);
+	
+	// op, number of topics, topics
+	if(len < 2 || len < 2 + 2 * (size_t)message[1])
+		return;
+	
+	if(_role == SimpleEspNowRole::CLIENT)
+	{
+		if(message[0] == SubscribeQuery && memcmp(mac, _serverMac, 6) == 0)
+			sendSubscriptions(SubscribeList, _subscriptions, _subscriptionCount);
+		
+		return;
+	}
+	
+	if(slot < 0)
+		return;
+	
+	peerDatabase._state[slot].subscriptionQueries = SubscriptionsKnown;
+	
+	if(message[0] == SubscribeList)
+		clearSubscriptions(slot);
+	
+	for(int i = 0; i<message[1]; i++)
+	{
+		uint16_t topic;
+		
+		memcpy(&topic, message+2+2*i, 2);
+		
+		int t = findTopic(topic, message[0] != SubscribeRemove);
+		
+		if(t < 0)
+			continue;
+		
+		if(message[0] != SubscribeRemove)
+			_topics[t].peers[slot/8] |= 1 << (slot%8);
+		else
+		{
+			_topics[t].peers[slot/8] &= ~(1 << (slot%8));
+			
+			if(getSubscriberCount(topic) == 0)
+				_topics[t].used = false;
+		}
+	}
+}
+
+void SimpleEspNowConnection::querySubscriptions(int slot)
+{
+	PeerDatabase::PeerState_t *state = &peerDatabase._state[slot];
+	
+	// a client which connected before the server restarted does not send CONNECT
+	// again, so its subscriptions are unknown until it is asked for them
+	if(state->subscriptionQueries == SubscriptionsKnown || state->subscriptionQueries >= SubscriptionQueryRetries ||
+	   (state->subscriptionQueries > 0 && millis() - state->lastSubscriptionQuery < SubscriptionQueryInterval))
+		return;
+	
+	uint8_t message[2] = {SubscribeQuery, 0};
+	
+	if(queueMessage(SimpleEspNowMessageType::SUBSCRIBE, message, sizeof(message), peerDatabase._peers[slot].mac) != 0)
+	{
+		state->subscriptionQueries++;
+		state->lastSubscriptionQuery = millis();
+	}
+}
+
+void SimpleEspNowConnection::clearSubscriptions(int slot)
+{
+    for(int i = 0; i<MaxTopicCount; i++)
+	{
+		if(!_topics[i].used)
+			continue;
+		
+		_topics[i].peers[slot/8] &= ~(1 << (slot%8));
+		
+		if(getSubscriberCount(_topics[i].topic) == 0)
+			_topics[i].used = false;
+	}
+}
+
+bool SimpleEspNowConnection::sendSubscriptions(uint8_t op, const uint16_t *topics, int count)
+{
+	if(_role != SimpleEspNowRole::CLIENT || _serverMac[0] == 0 || (count == 0 && op != SubscribeList))
+		return false;
+	
+	uint8_t message[2+2*MaxSubscriptions];
+	
+	message[0] = op;
+	message[1] = count;
+	memcpy(message+2, topics, 2*count);
+	
+	return queueMessage(SimpleEspNowMessageType::SUBSCRIBE, message, 2+2*count, _serverMac) != 0;
+}
+
+bool SimpleEspNowConnection::subscribe(uint16_t topic)
+{
+	if(_role != SimpleEspNowRole::CLIENT)
+		return false;
+	
+    for(int i = 0; i<_subscriptionCount; i++)
+	{
+		if(_subscriptions[i] == topic)
+			return true;
+	}
+	
+	if(_subscriptionCount >= MaxSubscriptions)
+		return false;
+	
+	_subscriptions[_subscriptionCount++] = topic;
+	
+	// without a server the subscription is sent with the next CONNECT
+	if(_serverMac[0] != 0)
+		sendSubscriptions(SubscribeAdd, &topic, 1);
+	
+	return true;
+}
+
+bool SimpleEspNowConnection::unsubscribe(uint16_t topic)
+{
+    for(int i = 0; i<_subscriptionCount; i++)
+	{
+		if(_subscriptions[i] == topic)
+		{
+			_subscriptions[i] = _subscriptions[--_subscriptionCount];
+			sendSubscriptions(SubscribeRemove, &topic, 1);
+			
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+int SimpleEspNowConnection::publish(uint16_t topic, const uint8_t* message, size_t len)
+{
+	uint8_t *bu = new uint8_t[len+2];
+	int ret = 0;
+	
+	memcpy(bu, &topic, 2);
+	memcpy(bu+2, message, len);
+	
+	if(_role == SimpleEspNowRole::CLIENT)
+	{
+		ret = queueMessage(SimpleEspNowMessageType::PUBLISH, bu, len+2, _serverMac) != 0 ? 1 : 0;
+		delete[] bu;
+		
+		return ret;
+	}
+	
+	int t = findTopic(topic, false);
+	
+	if(t >= 0)
+	{
+		uint8_t devices[MaxPeerCount][6];
+		int count = 0;
+		size_t fragmentSize = EspNowLocalFrameSize;
+		
+		for(int slot = 0; slot<MaxPeerCount; slot++)
+		{
+			if((_topics[t].peers[slot/8] & (1 << (slot%8))) == 0)
+				continue;
+			
+			memcpy(devices[count++], peerDatabase._peers[slot].mac, 6);
+			
+			// fragmented once, so the smallest frame size of all subscribers is used
+			size_t size = getFragmentSize(peerDatabase._peers[slot].mac);
+			
+			if(size < fragmentSize)
+				fragmentSize = size;
+		}
+		
+		ret = deviceSendMessageBuffer.createSharedBuffer(devices, count, bu, len+2, fragmentSize, SimpleEspNowMessageType::PUBLISH);
+		trace(ret > 0 ? TRACE_QUEUE : TRACE_REJECT, NULL, 0, ret, SimpleEspNowMessageType::PUBLISH);
+		
+		if(ret > 0)
+			notifyTransmit();
+	}
+	
+	delete[] bu;
+	
+	return ret;
+}
+
+int SimpleEspNowConnection::getSubscriberCount(uint16_t topic)
+{
+	int t = findTopic(topic, false);
+	int count = 0;
+	
+	if(t < 0)
+		return 0;
+	
+    for(int i = 0; i<(MaxPeerCount+7)/8; i++)
+	{
+		for(uint8_t b = _topics[t].peers[i]; b != 0; b &= b-1)
+			count++;
+	}
+	
+	return count;
+}
+
+#define OtaBegin 1		// size, block size, md5
+#define OtaData 2		// block number, data
+#define OtaAck 3		// next block expected, 1 if blocks are missing
+#define OtaResult 4		// 0 if the image was verified
+#define OtaAbort 5
+#define OtaHeaderSize 5	// op and block number in front of the data
+#define OtaNoBlock 0xFFFFFFFF
+
+int SimpleEspNowConnection::findOtaSession(const uint8_t *mac)
+{
+    for(int i = 0; i<MaxOtaSessions; i++)
+	{
+		if(_otaSessions[i].used && memcmp(_otaSessions[i].peer, mac, 6) == 0)
+			return i;
+	}
+	
+	return -1;
+}
+
+bool SimpleEspNowConnection::startOta(const uint8_t* mac, uint32_t size, const uint8_t* md5, OtaReadFunction fn)
+{
+	if(_role != SimpleEspNowRole::SERVER || mac == NULL || md5 == NULL || size == 0 || !fn || findOtaSession(mac) >= 0)
+		return false;
+	
+    for(int i = 0; i<MaxOtaSessions; i++)
+	{
+		OtaSession_t *s = &_otaSessions[i];
+		
+		if(s->used)
+			continue;
+		
+		s->used = true;
+		s->begun = false;
+		memcpy(s->peer, mac, 6);
+		memcpy(s->md5, md5, 16);
+		s->size = size;
+		s->blockSize = getFragmentSize(mac) - OtaHeaderSize;	// one block per frame
+		s->blocks = (size + s->blockSize - 1) / s->blockSize;
+		s->base = 0;
+		s->next = 0;
+		s->lastAck = millis() - OtaTimeout;	// BEGIN goes out with the next loop()
+		s->lastProgress = s->lastAck;
+		s->ackTime = 0;
+		s->retries = 0;
+		s->ackNext = 0;
+		s->ackMissing = false;
+		s->ackPending = false;
+		s->resent = false;
+		s->finished = false;
+		s->read = fn;
+		
+		return true;
+	}
+	
+	return false;
+}
+
+bool SimpleEspNowConnection::cancelOta(const uint8_t* mac)
+{
+	int s = findOtaSession(mac);
+	
+	if(s < 0)
+		return false;
+	
+	sendOtaControl(mac, OtaAbort, 0, 0);
+	_otaSessions[s].used = false;
+	_otaSessions[s].read = NULL;
+	
+	return true;
+}
+
+int SimpleEspNowConnection::getOtaProgress(const uint8_t* mac)
+{
+	if(_role == SimpleEspNowRole::CLIENT)
+		return _otaActive && _otaBlocks > 0 ? (int)((uint64_t)_otaNext * 100 / _otaBlocks) : -1;
+	
+	int s = mac != NULL ? findOtaSession(mac) : -1;
+	
+	if(s < 0)
+		return -1;
+	
+	return (int)((uint64_t)_otaSessions[s].base * 100 / _otaSessions[s].blocks);
+}
+
+bool SimpleEspNowConnection::setOtaTarget(SimpleEspNowOtaTarget* target)
+{
+	if(_role != SimpleEspNowRole::CLIENT)
+		return false;
+	
+	_otaTarget = target;
+	
+	return true;
+}
+
+bool SimpleEspNowConnection::sendOtaControl(const uint8_t *mac, uint8_t op, uint32_t value, uint8_t status)
+{
+	uint8_t message[6];
+	
+	message[0] = op;
+	memcpy(message+1, &value, 4);
+	message[5] = status;
+	
+	return queueMessage(SimpleEspNowMessageType::OTA, message, sizeof(message), mac) != 0;
+}
+
+void SimpleEspNowConnection::finishOta(const uint8_t *mac, bool success)
+{
+#ifdef DEBUG
+	Serial.printf("SimpleEspNowConnection::firmware transfer %s\n", success ? "finished" : "failed");
+#endif	
+
+	if(_OtaFinishedFunction)
+		_OtaFinishedFunction((uint8_t *)mac, success);
+}
+
+void SimpleEspNowConnection::handleOta(const uint8_t *mac, const uint8_t *message, size_t len)
+{
+	if(len < 1)
+		return;
+	
+	if(_role == SimpleEspNowRole::CLIENT)
+	{
+		if(_otaTarget == NULL || memcmp(mac, _serverMac, 6) != 0)
+			return;
+		
+		if(message[0] == OtaData && !_otaActive && _otaDone)
+		{
+			_otaResultDue = true;	// the server did not get the result and sends the last blocks again
+		}
+		else if(message[0] == OtaBegin && len >= 1+sizeof(_otaBeginMessage))
+		{
+			// flash operations are too slow for the receive callback, loop() starts the transfer
+			memcpy(_otaBeginMessage, message+1, sizeof(_otaBeginMessage));
+			_otaBeginPending = true;
+		}
+		else if(message[0] == OtaAbort)
+		{
+			_otaAbortPending = true;
+		}
+		else if(message[0] == OtaData && len > OtaHeaderSize && _otaActive)
+		{
+			uint32_t block;
+			size_t dataLen = len - OtaHeaderSize;
+			
+			memcpy(&block, message+1, 4);
+			
+			if(dataLen > _otaBlockSize)
+				return;
+			
+			if(block < _otaNext)
+			{
+				_otaAckDue = true;	// already written
+				return;
+			}
+			
+			if(block >= _otaNext + OtaWindowSize)
+			{
+				_otaGap = true;
+				_otaGapBlocks = _otaGapBlocks + 1;
+				return;
+			}
+			
+			int i = block % OtaWindowSize;
+			
+			// loop() frees the ring when the transfer ends, a buffered block is not copied again
+			EspNowLock(_lock);
+			
+			if(_otaRing != NULL && _otaRingBlock[i] != block)
+			{
+				memcpy(_otaRing + i*_otaBlockSize, message+OtaHeaderSize, dataLen);
+				_otaRingLen[i] = dataLen;
+				_otaRingBlock[i] = block;
+			}
+			
+			EspNowUnlock(_lock);
+			
+			if(block > _otaNext && _otaRingBlock[_otaNext % OtaWindowSize] != _otaNext)
+			{
+				_otaGap = true;	// an earlier block got lost
+				_otaGapBlocks = _otaGapBlocks + 1;
+			}
+		}
+		
+		return;
+	}
+	
+	int s = findOtaSession(mac);
+	
+	if(s < 0)
+		return;
+	
+	OtaSession_t *session = &_otaSessions[s];
+	
+	if(session->finished)
+		return;
+	
+	if(message[0] == OtaAck && len >= 6)
+	{
+		uint32_t next;
+		
+		memcpy(&next, message+1, 4);
+		
+		if(next > session->blocks)
+			return;
+		
+		// loop() sends the blocks, it applies the latest acknowledgement
+		EspNowLock(_lock);
+		
+		session->ackMissing = (session->ackPending && session->ackNext == next && session->ackMissing) || message[5] != 0;
+		session->ackNext = next;
+		session->ackPending = true;
+		
+		EspNowUnlock(_lock);
+	}
+	else if((message[0] == OtaResult && len >= 6) || message[0] == OtaAbort)
+	{
+		// loop() may be reading a block of this session, it ends the session there
+		EspNowLock(_lock);
+		
+		session->success = message[0] == OtaResult && message[5] == 0;
+		session->finished = true;
+		
+		EspNowUnlock(_lock);
+	}
+}
+
+void SimpleEspNowConnection::processOtaSessions()
+{
+	unsigned long now = millis();
+	
+    for(int i = 0; i<MaxOtaSessions; i++)
+	{
+		OtaSession_t *s = &_otaSessions[i];
+		
+		if(!s->used)
+			continue;
+		
+		if(s->ackPending)
+		{
+			EspNowLock(_lock);
+			
+			uint32_t next = s->ackNext;
+			bool missing = s->ackMissing;
+			
+			s->ackPending = false;
+			
+			EspNowUnlock(_lock);
+			
+			if(!s->begun)
+				s->lastProgress = now;
+			
+			s->begun = true;
+			s->lastAck = now;
+			
+			if(next > s->base)
+			{
+				unsigned long sample = now - s->lastProgress > 0 ? now - s->lastProgress : 1;
+				
+				// blocks sent again say nothing about the time one window takes
+				if(!s->resent)
+					s->ackTime = s->ackTime > 0 ? (3*s->ackTime + sample) / 4 : sample;
+				
+				s->resent = false;
+				s->lastProgress = now;
+				s->base = next;
+				s->retries = 0;
+			}
+			
+			// go back to the first missing block, the receiver keeps what it already has
+			if(missing || s->next < s->base)
+			{
+				s->resent |= missing;
+				s->next = next;
+			}
+		}
+		
+		// four times the usual time between two acknowledgements, doubled with every retry
+		unsigned long timeout = s->ackTime > 0 ? 4 * s->ackTime : OtaTimeout / 8;
+		
+		if(timeout < OtaMinTimeout)
+			timeout = OtaMinTimeout;
+		
+		timeout = s->retries < 8 && (timeout << s->retries) < OtaTimeout ? timeout << s->retries : OtaTimeout;
+		
+		if(s->finished || (now - s->lastAck >= timeout && ++s->retries > OtaMaxRetries))
+		{
+			uint8_t peer[6];
+			bool success = s->finished && s->success;
+			
+			memcpy(peer, s->peer, 6);
+			s->used = false;
+			s->read = NULL;
+			finishOta(peer, success);
+			continue;
+		}
+		
+		if(now - s->lastAck >= timeout)
+		{
+			s->lastAck = now;
+			
+			// BEGIN also resumes a transfer and asks for a lost result
+			if(!s->begun || s->base >= s->blocks)
+			{
+				uint8_t message[1+23];
+				
+				message[0] = OtaBegin;
+				memcpy(message+1, &s->size, 4);
+				memcpy(message+5, &s->blockSize, 2);
+				memcpy(message+7, s->md5, 16);
+				queueMessage(SimpleEspNowMessageType::OTA, message, sizeof(message), s->peer);
+				continue;
+			}
+			
+			s->next = s->base;
+			s->resent = true;
+		}
+		
+		if(!s->begun)
+			continue;
+		
+		// keep the window full, but leave room in the send buffer for other traffic
+		while(s->next < s->blocks && s->next < s->base + OtaWindowSize &&
+			  deviceSendMessageBuffer.getQueuedCount(s->peer) < OtaWindowSize / 2)
+		{
+			uint8_t message[OtaHeaderSize + s->blockSize];
+			uint32_t offset = s->next * s->blockSize;
+			size_t len = s->size - offset < s->blockSize ? s->size - offset : s->blockSize;
+			
+			message[0] = OtaData;
+			memcpy(message+1, &s->next, 4);
+			
+			if(s->read(offset, message+OtaHeaderSize, len) != len ||
+			   queueMessage(SimpleEspNowMessageType::OTA, message, OtaHeaderSize+len, s->peer) == 0)
+				break;
+			
+			s->next++;
+		}
+	}
+}
+
+void SimpleEspNowConnection::freeOtaRing()
+{
+	// the receive callback copies blocks into the ring while holding the lock
+	EspNowLock(_lock);
+	
+	uint8_t *ring = _otaRing;
+	
+	_otaRing = NULL;
+	
+	EspNowUnlock(_lock);
+	
+	if(ring != NULL)
+		delete[] ring;
+}
+
+void SimpleEspNowConnection::processOtaTarget()
+{
+	if(_otaTarget == NULL)
+		return;
+	
+	if(_otaAbortPending)
+	{
+		_otaAbortPending = false;
+		
+		if(_otaActive)
+		{
+			_otaActive = false;
+			_otaTarget->abort();
+			freeOtaRing();
+			finishOta(_serverMac, false);
+		}
+	}
+	
+	if(_otaResultDue)
+	{
+		_otaResultDue = false;
+		
+		if(_otaDone)
+			sendOtaControl(_serverMac, OtaResult, 0, _otaResult ? 0 : 1);
+	}
+	
+	if(_otaBeginPending)
+	{
+		uint32_t size;
+		uint16_t blockSize;
+		const uint8_t *md5 = _otaBeginMessage+6;
+		
+		_otaBeginPending = false;
+		memcpy(&size, _otaBeginMessage, 4);
+		memcpy(&blockSize, _otaBeginMessage+4, 2);
+		
+		bool sameImage = size == _otaSize && blockSize == _otaBlockSize && memcmp(md5, _otaMd5, 16) == 0;
+		
+		if(sameImage && _otaDone)
+		{
+			sendOtaControl(_serverMac, OtaResult, 0, _otaResult ? 0 : 1);	// the result got lost
+			return;
+		}
+		
+		if(sameImage && _otaActive)
+		{
+			// interrupted transfer, continue with the first block not written yet
+			_otaAckedNext = _otaNext;
+			_otaNackedNext = OtaNoBlock;
+			_otaGap = false;
+			_otaGapBlocks = 0;
+			sendOtaControl(_serverMac, OtaAck, _otaNext, 0);
+			return;
+		}
+		
+		if(_otaActive)
+		{
+			_otaActive = false;
+			_otaTarget->abort();
+		}
+		
+		freeOtaRing();
+		_otaDone = false;
+		_otaSize = size;
+		_otaBlockSize = blockSize;
+		_otaBlocks = blockSize > 0 ? (size + blockSize - 1) / blockSize : 0;
+		memcpy(_otaMd5, md5, 16);
+		
+		if(size == 0 || blockSize == 0 || blockSize > EspNowLocalFrameSize || !_otaTarget->begin(size, md5))
+		{
+			sendOtaControl(_serverMac, OtaAbort, 0, 0);
+			return;
+		}
+		
+		_otaRing = new uint8_t[OtaWindowSize * blockSize];
+		
+		for(int i = 0; i<OtaWindowSize; i++)
+			_otaRingBlock[i] = OtaNoBlock;
+		
+		_otaNext = 0;
+		_otaAckedNext = 0;
+		_otaNackedNext = OtaNoBlock;
+		_otaGap = false;
+		_otaGapBlocks = 0;
+		_otaAckDue = false;
+		_otaResultDue = false;
+		_otaActive = true;
+		sendOtaControl(_serverMac, OtaAck, 0, 0);
+	}
+	
+	if(!_otaActive)
+		return;
+	
+	// write the consecutive blocks, the slot is released before _otaNext moves on
+	for(int i = _otaNext % OtaWindowSize; _otaRingBlock[i] == _otaNext; i = _otaNext % OtaWindowSize)
+	{
+		if(!_otaTarget->write(_otaNext * _otaBlockSize, _otaRing + i*_otaBlockSize, _otaRingLen[i]))
+		{
+			_otaActive = false;
+			_otaTarget->abort();
+			freeOtaRing();
+			sendOtaControl(_serverMac, OtaAbort, 0, 0);
+			finishOta(_serverMac, false);
+			return;
+		}
+		
+		_otaRingBlock[i] = OtaNoBlock;
+		_otaNext = _otaNext + 1;
+	}
+	
+	if(_otaNext >= _otaBlocks)
+	{
+		_otaResult = _otaTarget->end();	// verifies the MD5 hash
+		_otaActive = false;
+		_otaDone = true;
+		freeOtaRing();
+		sendOtaControl(_serverMac, OtaResult, 0, _otaResult ? 0 : 1);
+		finishOta(_serverMac, _otaResult);
+		return;
+	}
+	
+	// a gap is reported again when the blocks sent behind it keep arriving without it
+	if(_otaGap && (_otaNackedNext != _otaNext || _otaGapBlocks >= OtaWindowSize / 2))
+	{
+		_otaGap = false;
+		_otaGapBlocks = 0;
+		_otaNackedNext = _otaNext;
+		_otaAckedNext = _otaNext;
+		sendOtaControl(_serverMac, OtaAck, _otaNext, 1);
+	}
+	else if(_otaAckDue || _otaNext - _otaAckedNext >= OtaWindowSize / 2)
+	{
+		_otaAckDue = false;
+		_otaAckedNext = _otaNext;
+		sendOtaControl(_serverMac, OtaAck, _otaNext, 0);
+	}
+}
+
+uint16_t SimpleEspNowConnection::request(uint8_t* message, size_t len, unsigned long timeoutMs, ResponseFunction fn)
+{
+	return request(_serverMac, message, len, timeoutMs, fn);
+}
+
+uint16_t SimpleEspNowConnection::request(const uint8_t* mac, uint8_t* message, size_t len, unsigned long timeoutMs, ResponseFunction fn)
+{
+	if(mac == NULL)
+		return 0;
+	
+	if(_role == SimpleEspNowRole::CLIENT)
+		mac = _serverMac;
+	
+	int index = -1;
+	uint16_t requestId = 0;
+	ResponseFunction callback = fn; // copied outside the lock, swapped in under it
+	
+	EspNowLock(_lock);
+    for(int i = 0; i<MaxPendingRequests; i++)
+    {
+		if(!_requests[i].used)
+		{
+			index = i;
+			break;
+		}
+	}
+	
+	if(index >= 0)
+	{
+		if(++_requests[index].generation == 0) // id 0 is reserved for errors
+			_requests[index].generation = 1;
+		
+		requestId = (_requests[index].generation << 8) | index;
+		
+		_requests[index].used = true;
+		memcpy(_requests[index].peer, mac, 6);
+		_requests[index].deadline = millis() + timeoutMs;
+		callback.swap(_requests[index].callback);
 	}
+	EspNowUnlock(_lock);
 	
-	return true;
-}
-uint8_t* SimpleEspNowConnection::strToMac(const char* str)
-{
-	if(strlen(str) != 12)
-		return NULL;
+	if(index < 0)
+		return 0;
 	
-	uint8_t* mac = new uint8_t[6];
+	uint8_t *bu = new uint8_t[len+2];
 	
-	char buffer[2];
+	memcpy(bu, &requestId, 2);
+	memcpy(bu+2, message, len);
 	
-	for(int i = 0; i<6; i++)
+	bool ret = queueMessage(SimpleEspNowMessageType::REQUEST, bu, len+2, mac);
+	
+	delete[] bu;
+	
+	if(!ret)
 	{
-		strncpy ( buffer, str+i*2, 2 );
+		cancelRequest(requestId);
 		
-		mac[i] = strtol(buffer, NULL, 16);
+		return 0;
 	}
 	
-	return mac;
+	return requestId;
 }
 
-String SimpleEspNowConnection::macToStr(const uint8_t* mac)
+bool SimpleEspNowConnection::respond(const uint8_t* mac, uint16_t requestId, uint8_t* message, size_t len)
 {
-	char macAddr[13];
-	macAddr[12] = 0;
+	if(mac == NULL || requestId == 0)
+		return false;
 	
-	sprintf(macAddr, "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);		
-
-	return String(macAddr);
+	uint8_t *bu = new uint8_t[len+2];
+	
+	memcpy(bu, &requestId, 2);
+	memcpy(bu+2, message, len);
+	
+	bool ret = queueMessage(SimpleEspNowMessageType::RESPONSE, bu, len+2, mac);
+	
+	delete[] bu;
+	
+	return ret;
 }
 
-
-#if defined(ESP8266)
-void SimpleEspNowConnection::onReceiveData(uint8_t *mac, uint8_t *data, uint8_t len) 
-#elif defined(ESP32)
-void SimpleEspNowConnection::onReceiveData(const uint8_t *mac, const uint8_t *data, int len)
-#endif
+bool SimpleEspNowConnection::cancelRequest(uint16_t requestId)
 {
-	if(len <= 7)
-		return;
-	
-	uint8_t buffer[len-6];
-	buffer[len-7] = 0;
-	long id;
-	
-	memcpy(buffer, data+7, len-7);
-	memcpy(&id, data+3, 4);
+	int index = requestId & 0xFF;
+	ResponseFunction fn; // destroyed outside the lock
+	bool claimed = false;
 	
-	if(simpleEspNowConnection->_role == SimpleEspNowRole::CLIENT &&
-		simpleEspNowConnection->_pairingOngoing)
+	EspNowLock(_lock);
+	if(index < MaxPendingRequests && _requests[index].used && _requests[index].generation == (requestId >> 8))
 	{
-		if(data[0] == SimpleEspNowMessageType::PAIR)			
-		{
-			if(simpleEspNowConnection->_NewGatewayAddressFunction)
-			{
-#if defined(ESP8266)
-				wifi_set_macaddr(STATION_IF, &simpleEspNowConnection->_myAddress[0]);
-#elif defined(ESP32)
-				esp_wifi_set_mac(WIFI_IF_STA, &simpleEspNowConnection->_myAddress[0]);
-#endif				
-				simpleEspNowConnection->endPairing();
-				simpleEspNowConnection->_NewGatewayAddressFunction((uint8_t *)mac, String(simpleEspNowConnection->macToStr((uint8_t *)mac)));
-				
-				uint8_t sendMessage[13];
-				long ids = millis();
-
-				sendMessage[0] = SimpleEspNowMessageType::PAIR;	// Type of message
-				sendMessage[1] = 1;	// 1st package
-				sendMessage[2] = 1;	// from 1 package. Will be enhanced in one of the next versions
-				memcpy(sendMessage+3, &ids, 4);	
-				
-				memcpy(sendMessage+7, simpleEspNowConnection->_myAddress, 6);
-				
-				esp_now_send(mac, (uint8_t *) sendMessage, sizeof(sendMessage));
-			}
-		}
+		_requests[index].used = false;
+		fn.swap(_requests[index].callback);
+		claimed = true;
 	}
-	else
-	{
-		if(data[0] == SimpleEspNowMessageType::DATA && simpleEspNowConnection->_MessageFunction)
-		{
-#ifdef DEBUG
-			Serial.printf("Package %d of %d packages\n", data[1], data[2]);
-#endif			
-
-			if(data[1] == 1 && data[2] > 1)  // prepare memory for this device
-			{
-				simpleEspNowConnection->deviceReceiveMessageBuffer.createBuffer(mac, id, data[2]);				
-				simpleEspNowConnection->deviceReceiveMessageBuffer.addBuffer(mac, id, (uint8_t *)buffer, len-7, data[1]-1);
-			}
-			else if(data[2] > 1)
-			{
-				simpleEspNowConnection->deviceReceiveMessageBuffer.addBuffer(mac, id, (uint8_t *)buffer, len-7, data[1]-1);
-			}
+	EspNowUnlock(_lock);
+	
+	return claimed;
+}
 
-			if(data[1] == data[2])
-			{
-				if(data[2] > 1)
-				{
-					size_t blen = simpleEspNowConnection->deviceReceiveMessageBuffer.getBufferSize(mac, id, data[2]);
-					uint8_t *bb = simpleEspNowConnection->deviceReceiveMessageBuffer.getBuffer(mac, id, data[2], blen);
-					
-					simpleEspNowConnection->_MessageFunction(	(uint8_t *)mac, 
-																bb,
-																blen);
-					delete(bb);
-					simpleEspNowConnection->deviceReceiveMessageBuffer.deleteBuffer(mac, id);
-				}
-				else					
-					simpleEspNowConnection->_MessageFunction((uint8_t *)mac, buffer, len-7);
-			}
-		}
-		if(simpleEspNowConnection->_PairedFunction)
-		{		
-			if(data[0] == SimpleEspNowMessageType::PAIR)			
-				simpleEspNowConnection->_PairedFunction((uint8_t *)mac, String(simpleEspNowConnection->macToStr((uint8_t *)buffer)));			
-		}
-		if(simpleEspNowConnection->_ConnectedFunction)
+void SimpleEspNowConnection::checkRequestTimeouts()
+{
+	unsigned long now = millis();
+	
+    for(int i = 0; i<MaxPendingRequests; i++)
+    {
+		ResponseFunction fn;
+		uint8_t peer[6];
+		uint16_t requestId = 0;
+		
+		// a response arriving meanwhile either claims the slot first or finds it free
+		EspNowLock(_lock);
+		if(_requests[i].used && (long)(now - _requests[i].deadline) >= 0)
 		{
-			if(data[0] == SimpleEspNowMessageType::CONNECT)
-				simpleEspNowConnection->_ConnectedFunction((uint8_t *)mac, String(simpleEspNowConnection->macToStr((uint8_t *)buffer)));							
+			requestId = (_requests[i].generation << 8) | i;
+			memcpy(peer, _requests[i].peer, 6);
+			_requests[i].used = false;
+			fn.swap(_requests[i].callback);
 		}
+		EspNowUnlock(_lock);
 		
-#ifdef DEBUG
-		Serial.println("SimpleEspNowConnection::message arrived from : "+simpleEspNowConnection->macToStr((uint8_t *)mac));
-#endif	
+		if(fn)
+			fn(peer, requestId, SimpleEspNowRequestResult::REQUEST_TIMEOUT, NULL, 0);
 	}
 }
 
@@ -756,33 +3497,41 @@ bool SimpleEspNowConnection::setServerMac(uint8_t* mac)
 		return false;
 	
 	memcpy(_serverMac, mac, 6);
-	simpleEspNowConnection->macToStr(_serverMac);
+	peerDatabase.addPeer(_serverMac); // keeps the duplicate window of the server
 	
 #ifdef DEBUG
 	Serial.println("EspNowConnection::setServerMac to "+simpleEspNowConnection->macToStr(_serverMac));
 #endif
 
-	char sendMessage[13];
+	char sendMessage[19];
 	long ids = millis();		
+	uint32_t t1 = millis();
+	uint16_t frameSize = EspNowLocalFrameSize;
 
-
-	
 	sendMessage[0] = SimpleEspNowMessageType::CONNECT;	// Type of message
 	sendMessage[1] = 1;	// 1st package
 	sendMessage[2] = 1;	// from 1 package. WIll be enhanced in one of the next versions
 	memcpy(sendMessage+3, &ids, 4);	
 
-
-	sendMessage[14] = 0;
-	
 	memcpy(sendMessage+7, simpleEspNowConnection->_myAddress, 6);
+	memcpy(sendMessage+13, &t1, 4);	// the server answers with a time sync reply
+	memcpy(sendMessage+17, &frameSize, 2);	// largest frame we accept, the server tells its own in the reply
+	
+	_timeSynced = false;
+	_clockSkew = 0;
+	_lastTimeSyncRequest = t1;
+	_txSlot = -1;	// the server hands out a new slot if it runs the slotted mode
 
 #if defined(ESP32)
 	memcpy(&simpleEspNowConnection->_serverMacPeerInfo.peer_addr, _serverMac, 6);
 	esp_now_add_peer(&simpleEspNowConnection->_serverMacPeerInfo);
 #endif
 	
-	esp_now_send(mac, (uint8_t *) sendMessage, sizeof(sendMessage));
+	// goes through the relay if the server is out of range
+	queueFrame(_serverMac, (uint8_t *) sendMessage, sizeof(sendMessage));
+	
+	// the server forgets the subscriptions of a connecting client
+	sendSubscriptions(SubscribeAdd, _subscriptions, _subscriptionCount);
 	
 	return true;
 }
@@ -812,6 +3561,26 @@ void SimpleEspNowConnection::onPairingFinished(PairingFinishedFunction fn)
 	_PairingFinishedFunction = fn;
 }
 
+void SimpleEspNowConnection::onRequest(RequestFunction fn)
+{
+	_RequestFunction = fn;
+}
+
+void SimpleEspNowConnection::onMessageComplete(MessageCompleteFunction fn)
+{
+	_MessageCompleteFunction = fn;
+}
+
+void SimpleEspNowConnection::onPublish(PublishFunction fn)
+{
+	_PublishFunction = fn;
+}
+
+void SimpleEspNowConnection::onOtaFinished(OtaFinishedFunction fn)
+{
+	_OtaFinishedFunction = fn;
+}
+
 void SimpleEspNowConnection::onSendError(SendErrorFunction fn)
 {
 	_SendErrorFunction = fn;
@@ -827,22 +3596,269 @@ bool SimpleEspNowConnection::isSendBufferEmpty()
 	return deviceSendMessageBuffer.isSendBufferEmpty() && !_openTransaction;
 }
 
+bool SimpleEspNowConnection::setPeerStorage(SimpleEspNowPeerStorage* storage)
+{
+	return peerDatabase.load(storage);
+}
+
+bool SimpleEspNowConnection::setPeerFlushInterval(unsigned long intervalMs)
+{
+	_peerFlushInterval = intervalMs;
+	
+	return true;
+}
+
+bool SimpleEspNowConnection::flushPeers()
+{
+	_lastPeerFlush = millis();
+	
+	return peerDatabase.flush();
+}
+
+SimpleEspNowPeer_t* SimpleEspNowConnection::getPeer(const uint8_t* mac)
+{
+	int slot = peerDatabase.findPeer(mac);
+	
+	return slot < 0 ? NULL : &peerDatabase._peers[slot];
+}
+
+SimpleEspNowPeer_t* SimpleEspNowConnection::getPeer(String address)
+{
+	uint8_t *mac = strToMac(address.c_str());
+	
+	if(mac == NULL)
+		return NULL;
+	
+	SimpleEspNowPeer_t* peer = getPeer(mac);
+	
+	delete[] mac;
+	
+	return peer;
+}
+
+SimpleEspNowPeer_t* SimpleEspNowConnection::getPeerBySlot(int slot)
+{
+	if(slot < 0 || slot >= MaxPeerCount || peerDatabase._peers[slot].flags != PeerUsed)
+		return NULL;
+	
+	return &peerDatabase._peers[slot];
+}
+
+int SimpleEspNowConnection::getPeerCount()
+{
+	return peerDatabase._count;
+}
+
+bool SimpleEspNowConnection::addPeer(const uint8_t* mac)
+{
+	return peerDatabase.addPeer(mac) >= 0;
+}
+
+bool SimpleEspNowConnection::removePeer(const uint8_t* mac)
+{
+	int slot = peerDatabase.findPeer(mac);
+	
+	if(slot >= 0)
+		clearSubscriptions(slot);
+	
+	return peerDatabase.removePeer(mac);
+}
+
+bool SimpleEspNowConnection::setPeerTag(const uint8_t* mac, uint16_t tag)
+{
+	int slot = peerDatabase.findPeer(mac);
+	
+	if(slot < 0)
+		return false;
+	
+	peerDatabase._peers[slot].tag = tag;
+	peerDatabase.markDirty(slot);
+	
+	return true;
+}
+
 bool SimpleEspNowConnection::loop()
+{
+	if(peerDatabase.isFlushUrgent() || millis() - _lastPeerFlush >= _peerFlushInterval)
+	{
+		peerDatabase.flush();
+		_lastPeerFlush = millis();
+	}
+	
+	checkRequestTimeouts();
+	
+	if(_role == SimpleEspNowRole::SERVER)
+	{
+		sendSlotAssignments();
+		processOtaSessions();
+	}
+	else
+		processOtaTarget();
+	
+	if(_role == SimpleEspNowRole::CLIENT && _timeSyncInterval > 0 && _serverMac[0] != 0 &&
+	   millis() - _lastTimeSyncRequest >= _timeSyncInterval)
+	{
+		syncTime();
+	}
+	
+#if defined(ESP32)
+	if(_transmitEngine || _transmitTask != NULL)	// the task may still be ending
+#else
+	if(_transmitEngine)
+#endif
+		return !deviceSendMessageBuffer.isSendBufferEmpty();
+	
+	return transmitNext();
+}
+
+bool SimpleEspNowConnection::transmitNext()
 {
 	SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject *dbo = deviceSendMessageBuffer.getNextBuffer();
 
 	if(dbo == NULL)
 		return false;
+	if(!dbo->_raw && isMessageFailed(dbo->_id))
+	{
+		trace(TRACE_DROP, dbo->_device, dbo->_id, dbo->_counter);
+		deviceSendMessageBuffer.deleteBuffer(dbo);	// the receiver cannot reassemble it anymore
+		return true;
+	}
 	if(simpleEspNowConnection->_openTransaction)
 		return true;
+	if(!isInTransmitSlot())
+	{
+		if(!_slotWaiting)
+		{
+			_sendStatistics.slotDeferrals++;
+			trace(TRACE_SLOT_WAIT, dbo->_device, dbo->_id, dbo->_counter);
+		}
+		
+		_slotWaiting = true;
+		
+		return true;
+	}
+	
+	_slotWaiting = false;
+	
+	int slot = peerDatabase.findPeer(dbo->_device);
+	
+	if(slot >= 0)
+	{
+		SimpleEspNowQueueStatistics_t *st = &peerDatabase._state[slot].queue;
+		uint32_t delay = millis() - dbo->_queuedAt;
+		
+		st->sent++;
+		st->delaySum += delay;
+		if(delay > st->delayMax)
+			st->delayMax = delay;
+	}
 
-	sendPackage(dbo->_id, dbo->_counter, dbo->_packages, dbo->_message, dbo->_len, dbo->_device);
+	if(dbo->_raw)
+	{
+		stampFrame(dbo->_message, dbo->_len);
+		sendFrame(dbo->_device, dbo->_message, dbo->_len);
+	}
+	else
+	{
+		if(isTrackedType(dbo->_type))
+			_inFlightId = dbo->_id;
+		
+		sendPackage(dbo->_id, dbo->_counter, dbo->_packages, dbo->_message, dbo->_len, dbo->_device, dbo->_type);
+	}
 	
 	deviceSendMessageBuffer.deleteBuffer(dbo);
 	
 	return !deviceSendMessageBuffer.isSendBufferEmpty();	
 }
 
+bool SimpleEspNowConnection::setTransmitEngine(bool enable)
+{
+	if(!_supportLooping)
+		return false;
+	
+	_transmitEngine = enable;
+	
+#if defined(ESP32)
+	if(!enable)
+	{
+		notifyTransmit();	// the task ends itself, it could be in the middle of a send
+		
+		// loop() sends again once it returns, a callback running in the task cannot wait for it
+		if(xTaskGetCurrentTaskHandle() != _transmitTask)
+		{
+			while(_transmitTask != NULL)
+				vTaskDelay(1);
+		}
+		
+		return true;
+	}
+	
+	if(_transmitTask != NULL)
+		return true;
+	
+	if(xTaskCreate(SimpleEspNowConnection::transmitTask, "espnow_tx", TransmitTaskStackSize, this, TransmitTaskPriority, &_transmitTask) != pdPASS)
+	{
+		_transmitTask = NULL;
+		_transmitEngine = false;
+		return false;
+	}
+#elif defined(ESP8266)
+	if(!enable || _transmitScheduled)
+		return true;
+	
+	// runs after every loop() and while the sketch is in delay() or yield()
+	_transmitScheduled = schedule_recurrent_function_us([]()
+	{
+		if(!simpleEspNowConnection->_transmitEngine)
+		{
+			simpleEspNowConnection->_transmitScheduled = false;
+			return false;
+		}
+		
+		simpleEspNowConnection->transmitNext();
+		
+		return true;
+	}, 0);
+	
+	if(!_transmitScheduled)
+	{
+		_transmitEngine = false;
+		return false;
+	}
+#endif
+	
+	return true;
+}
+
+void SimpleEspNowConnection::notifyTransmit()
+{
+#if defined(ESP32)
+	TaskHandle_t task = _transmitTask;
+	
+	if(task != NULL)
+		xTaskNotifyGive(task);
+#endif
+}
+
+#if defined(ESP32)
+void SimpleEspNowConnection::transmitTask(void *arg)
+{
+	SimpleEspNowConnection *connection = (SimpleEspNowConnection *)arg;
+	
+	while(connection->_transmitEngine)
+	{
+		bool pending = connection->transmitNext();
+		
+		// woken by the send callback and by new messages, fragments waiting for
+		// their transmit slot or a released queue are tried again every tick
+		ulTaskNotifyTake(pdTRUE, pending ? 1 : portMAX_DELAY);
+	}
+	
+	connection->_transmitTask = NULL;
+	vTaskDelete(NULL);
+}
+#endif
+
 bool SimpleEspNowConnection::initServer()
 {
 	
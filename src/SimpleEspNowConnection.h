@@ -28,6 +28,18 @@ extern "C" {
 #include <esp_wifi.h>
 #include <esp_now.h>
 
+#if __has_include(<esp_idf_version.h>)
+#include <esp_idf_version.h>
+#endif
+
+// the ESP-NOW callbacks of ESP-IDF 5 (arduino-esp32 3.x) get info structs instead of the MAC
+#if defined(ESP_IDF_VERSION) && ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#define EspNowRecvInfo
+#endif
+#if defined(ESP_IDF_VERSION) && ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 5, 0)
+#define EspNowSendInfo
+#endif
+
 #if defined(DISABLE_BROWNOUT)
 #include "soc/soc.h"
 #include "soc/rtc_cntl_reg.h"
@@ -36,13 +48,195 @@ extern "C" {
 
 #include "Ticker.h"
 
+#if defined(ESP8266)
+#include <Schedule.h>
+#endif
+
 #define MaxBufferSize 50
+#define PairingHistogramBuckets 8
+
+#define EspNowMaxFrameSize 250	// maximum size of one EspNow frame
+#define EspNowHeaderSize 7		// type, package, packages and id
+#define EspNowFragmentSize 235	// payload of one fragment to a legacy peer
+#define RelayHeaderSize 14		// type, hops, origin and destination of a relayed frame
+
+#if defined(ESP_NOW_MAX_DATA_LEN_V2)
+#define EspNowLocalFrameSize ESP_NOW_MAX_DATA_LEN_V2	// ESP-NOW v2 frames of newer ESP-IDF releases
+#else
+#define EspNowLocalFrameSize EspNowMaxFrameSize
+#endif
+
+#define MaxRouteCount 16		// entries of the route cache for relayed peers
+#define MaxRelayHops 4
+#define RelayHistorySize 32		// recently forwarded fragments for duplicate suppression
+#define DedupWindowSize 32		// message ids per peer remembered for duplicate suppression
+#define MaxPendingRequests 8	// requests waiting for a response at the same time
+#define TimestampFlag 0x80		// set in the message type if a send timestamp follows the header
+#define TimestampSize 4
+#define LatencyHistogramBuckets 8
+#define SlotGuardTime 2			// ms at the end of a transmit slot without new frames
+#define SlotMaxRetries 3		// sends of a slot assignment the client did not acknowledge
+#define MaxTrackedMessages 64	// messages whose completion status is kept
+#define MaxTopicCount 32		// topics with subscribers on the server
+#define MaxSubscriptions 16		// topics one client can subscribe to
+#define SubscriptionQueryRetries 3		// times the server asks a client for its subscriptions
+#define SubscriptionQueryInterval 5000	// ms before the server asks again
+#define MaxOtaSessions 4		// firmware transfers the server runs at the same time
+#define OtaWindowSize 8			// blocks in flight per transfer
+#define OtaTimeout 1000			// ms without acknowledgement before blocks are sent again, at most
+#define OtaMinTimeout 20		// ms, at least, it follows the time between two acknowledgements
+#define OtaMaxRetries 10
+#define TransmitTaskStackSize 4096	// ESP32 transmit engine task
+#define TransmitTaskPriority 2		// above the Arduino loop task
+
+#define MaxPeerCount 64 // size of the peer database, must be a power of two
+
+// every queued message and the one in flight need a status
+#if MaxTrackedMessages <= MaxBufferSize
+#error "MaxTrackedMessages must be larger than MaxBufferSize"
+#endif
+
+#define TraceBufferSize 64 // records of the event trace, must be a power of two
+
+// Guards the state shared by application tasks, the ESP-NOW callbacks and
+// loop(). The ESP8266 runs all of them in one context and needs no lock.
+#if defined(ESP32)
+#define EspNowLockType portMUX_TYPE
+#define EspNowLockInitializer portMUX_INITIALIZER_UNLOCKED
+#define EspNowLock(lock) portENTER_CRITICAL(&(lock))
+#define EspNowUnlock(lock) portEXIT_CRITICAL(&(lock))
+#else
+#define EspNowLockType uint8_t
+#define EspNowLockInitializer 0
+#define EspNowLock(lock)
+#define EspNowUnlock(lock)
+#endif
 
 typedef enum SimpleEspNowRole 
 {
   SERVER = 0, CLIENT = 1
 } SimpleEspNowRole_t;
 
+typedef enum SimpleEspNowRequestResult
+{
+  REQUEST_OK = 0, REQUEST_TIMEOUT = 1
+} SimpleEspNowRequestResult_t;
+
+typedef enum SimpleEspNowMessageState
+{
+  MESSAGE_UNKNOWN = 0, MESSAGE_PENDING = 1, MESSAGE_DELIVERED = 2, MESSAGE_FAILED = 3
+} SimpleEspNowMessageState_t;
+
+typedef uint32_t SimpleEspNowMessageHandle; // returned by sendMessage, 0 if the message was not queued
+
+typedef struct SimpleEspNowMessageStatus
+{
+  SimpleEspNowMessageHandle handle;
+  SimpleEspNowMessageState_t state;
+  uint8_t fragments;
+  uint8_t fragmentsSent;	// fragments acknowledged by the receiver
+  uint8_t fragmentsFailed;	// fragments not acknowledged, the rest of the message is dropped
+  uint32_t sendTime;		// ms between sendMessage and the result of the last fragment
+} SimpleEspNowMessageStatus_t;
+
+typedef enum SimpleEspNowTraceEvent
+{
+  TRACE_QUEUE = 1,			// message queued, fragment = number of fragments, status = type
+  TRACE_REJECT = 2,			// message not queued, queue limit or buffer full
+  TRACE_SEND = 3,			// fragment handed to EspNow, status = type
+  TRACE_SEND_DONE = 4,		// send callback, status = EspNow send status
+  TRACE_COMPLETE = 5,		// message completed, status = SimpleEspNowMessageState_t
+  TRACE_DROP = 6,			// unsent fragment of a failed message dropped
+  TRACE_SLOT_WAIT = 7,		// fragment waits for the transmit slot
+  TRACE_RECEIVE = 8,		// frame received, status = type
+  TRACE_DUPLICATE = 9,		// duplicate fragment dropped
+  TRACE_DELIVER = 10,		// message delivered, status = type
+  TRACE_INCOMPLETE = 11,	// message with missing fragments dropped
+  TRACE_BEACON = 12,		// pairing beacon or pairing reply sent, fragment = beacon counter
+  TRACE_PAIRING_END = 13
+} SimpleEspNowTraceEvent_t;
+
+typedef struct SimpleEspNowTraceRecord
+{
+  uint32_t time;			// micros()
+  uint8_t event;			// SimpleEspNowTraceEvent_t
+  uint8_t peer;				// slot in the peer database, 0xFF if the peer is unknown
+  uint8_t fragment;
+  uint8_t status;
+  uint32_t id;				// message id
+} SimpleEspNowTraceRecord_t;
+
+typedef struct SimpleEspNowPairingStatistics
+{
+  uint16_t beaconsSent;		// pairing beacons sent in the current/last pairing window
+  uint16_t pairedClients;	// clients paired in the current/last pairing window
+  uint16_t latencyHistogram[PairingHistogramBuckets]; // <250ms, <500ms, <1s, <2s, <4s, <8s, <16s, >=16s after pairing start
+} SimpleEspNowPairingStatistics_t;
+
+typedef struct SimpleEspNowPeer
+{
+  uint8_t mac[6];
+  uint8_t flags;			// internal state of the database slot
+  uint8_t reserved;
+  uint16_t tag;				// free to use by the application
+  uint16_t frameSize;		// largest frame the peer accepts, 0 if it did not tell
+  uint32_t lastSeen;		// millis() when the last frame of this peer arrived, restarts at load()
+  uint32_t rxCount;			// frames received from this peer
+  uint32_t txCount;			// frames sent to this peer
+} SimpleEspNowPeer_t;
+
+// Storage backend for the peer database. The database is written as one
+// header followed by one fixed size record per slot, so a backend only has
+// to provide random access reads and writes.
+class SimpleEspNowPeerStorage
+{
+  public:
+	virtual ~SimpleEspNowPeerStorage() {}
+	
+	virtual bool begin(size_t size) = 0;
+	virtual bool read(size_t offset, uint8_t* data, size_t len) = 0;
+	virtual bool write(size_t offset, const uint8_t* data, size_t len) = 0;
+	virtual bool commit() { return true; }
+};
+
+// Receiver of a firmware image sent with startOta. Blocks are written in
+// order from loop(), end() has to verify the image against the MD5 hash.
+class SimpleEspNowOtaTarget
+{
+  public:
+	virtual ~SimpleEspNowOtaTarget() {}
+	
+	virtual bool begin(uint32_t size, const uint8_t* md5) = 0;
+	virtual bool write(uint32_t offset, const uint8_t* data, size_t len) = 0;
+	virtual bool end() = 0;
+	virtual void abort() {}
+};
+
+typedef struct SimpleEspNowLatencyStatistics
+{
+  uint32_t count;			// timestamped frames received from the peer
+  uint32_t min;				// one-way latency in ms
+  uint32_t max;
+  uint32_t sum;
+  uint16_t histogram[LatencyHistogramBuckets]; // <1ms, <2ms, <4ms, <8ms, <16ms, <32ms, <64ms, >=64ms
+} SimpleEspNowLatencyStatistics_t;
+
+typedef struct SimpleEspNowSendStatistics
+{
+  uint32_t framesSent;
+  uint32_t sendErrors;		// frames not acknowledged after the EspNow retries, mostly collisions
+  uint32_t slotDeferrals;	// fragments which had to wait for the transmit slot
+} SimpleEspNowSendStatistics_t;
+
+typedef struct SimpleEspNowQueueStatistics
+{
+  uint16_t queued;			// fragments waiting in the send buffer
+  uint32_t sent;			// fragments taken from the send buffer
+  uint32_t rejected;		// messages rejected because the queue limit was reached
+  uint32_t delaySum;		// time between sendMessage and transmission in ms
+  uint32_t delayMax;
+} SimpleEspNowQueueStatistics_t;
+
 class SimpleEspNowConnection 
 {   
   public:
@@ -53,21 +247,87 @@ class SimpleEspNowConnection
 	typedef std::function<void(uint8_t*)> SendErrorFunction;	
 	typedef std::function<void(uint8_t*)> SendDoneFunction;	
 	typedef std::function<void(void)> PairingFinishedFunction;	
+	typedef std::function<void(uint8_t*, uint16_t, const uint8_t*, size_t len)> RequestFunction;	
+	typedef std::function<void(uint8_t*, uint16_t, SimpleEspNowRequestResult_t, const uint8_t*, size_t len)> ResponseFunction;	
+	typedef std::function<void(uint8_t*, SimpleEspNowMessageStatus_t)> MessageCompleteFunction;	
+	typedef std::function<void(uint8_t*, uint16_t, const uint8_t*, size_t len)> PublishFunction;	
+	typedef std::function<size_t(uint32_t, uint8_t*, size_t len)> OtaReadFunction;	
+	typedef std::function<void(uint8_t*, bool)> OtaFinishedFunction;	
   
     SimpleEspNowConnection(SimpleEspNowRole role);
 
 	bool              begin();
 	bool              loop();
 	bool              isSendBufferEmpty();
+	bool              setTransmitEngine(bool enable);
 	bool              setServerMac(uint8_t* mac);
 	bool              setServerMac(String address);	
 	bool              setPairingMac(uint8_t* mac);		
-	bool 			  sendMessage(uint8_t* message, size_t len, String address = "");
-	bool 			  sendMessage(char* message, String address = "");
+	SimpleEspNowMessageHandle sendMessage(uint8_t* message, size_t len, String address = "");
+	SimpleEspNowMessageHandle sendMessage(uint8_t* message, size_t len, const uint8_t* mac);
+	SimpleEspNowMessageHandle sendMessage(char* message, String address = "");
+	SimpleEspNowMessageStatus_t getMessageStatus(SimpleEspNowMessageHandle handle);
 	bool 			  sendMessageOld(uint8_t* message, String address = "");
 	bool              setPairingBlinkPort(int pairingGPIO, bool invers = true);
 	bool 			  startPairing(int timeoutSec = 0);
 	bool 			  endPairing();
+	bool              setPairingSchedule(uint32_t fastIntervalMs, int fastCount, uint32_t maxIntervalMs);
+	bool              setPairingReplyJitter(uint32_t maxJitterMs);
+	SimpleEspNowPairingStatistics_t getPairingStatistics();
+	
+	bool              setPeerStorage(SimpleEspNowPeerStorage* storage);
+	bool              setPeerFlushInterval(unsigned long intervalMs);
+	bool              flushPeers();
+	SimpleEspNowPeer_t* getPeer(const uint8_t* mac);
+	SimpleEspNowPeer_t* getPeer(String address);
+	SimpleEspNowPeer_t* getPeerBySlot(int slot);
+	int               getPeerCount();
+	bool              addPeer(const uint8_t* mac);
+	bool              removePeer(const uint8_t* mac);
+	bool              setPeerTag(const uint8_t* mac, uint16_t tag);
+	
+	bool              setRelayMode(bool enable, uint8_t hopLimit = MaxRelayHops);
+	bool              setRelayMac(uint8_t* mac);
+	bool              setRelayMac(String address);
+	bool              clearRoutes();
+	uint32_t          getDuplicateCount(const uint8_t* mac = NULL);
+	size_t            getFrameSize(const uint8_t* mac);
+	
+	uint16_t          request(const uint8_t* mac, uint8_t* message, size_t len, unsigned long timeoutMs, ResponseFunction fn);
+	uint16_t          request(uint8_t* message, size_t len, unsigned long timeoutMs, ResponseFunction fn);
+	bool              respond(const uint8_t* mac, uint16_t requestId, uint8_t* message, size_t len);
+	bool              cancelRequest(uint16_t requestId);
+	
+	bool              syncTime();
+	bool              setTimeSyncInterval(unsigned long intervalMs);
+	bool              isTimeSynced();
+	uint32_t          getServerTime();
+	int32_t           getClockOffset();
+	float             getClockSkew();
+	uint32_t          getRoundTripTime();
+	bool              setSendTimestamps(bool enable);
+	SimpleEspNowLatencyStatistics_t getLatencyStatistics(const uint8_t* mac);
+	
+	bool              setSlottedMode(uint16_t frameMs, uint16_t slotMs);
+	int               getTransmitSlot();
+	SimpleEspNowSendStatistics_t getSendStatistics();
+	
+	bool              setPeerQueueLimit(int fragments);
+	SimpleEspNowQueueStatistics_t getQueueStatistics(const uint8_t* mac);
+	
+	bool              subscribe(uint16_t topic);
+	bool              unsubscribe(uint16_t topic);
+	int               publish(uint16_t topic, const uint8_t* message, size_t len);
+	int               getSubscriberCount(uint16_t topic);
+	
+	bool              startOta(const uint8_t* mac, uint32_t size, const uint8_t* md5, OtaReadFunction fn);
+	bool              cancelOta(const uint8_t* mac);
+	int               getOtaProgress(const uint8_t* mac = NULL);
+	bool              setOtaTarget(SimpleEspNowOtaTarget* target);
+	
+	int               getTrace(SimpleEspNowTraceRecord_t* records, int maxRecords);
+	void              dumpTrace(Print& out);
+	void              clearTrace();
 
 	void              onMessage(MessageFunction fn);
 	void              onNewGatewayAddress(NewGatewayAddressFunction fn);
@@ -76,6 +336,10 @@ class SimpleEspNowConnection
 	void 			  onSendError(SendErrorFunction fn);
 	void 			  onSendDone(SendDoneFunction fn);
 	void 			  onPairingFinished(PairingFinishedFunction fn);
+	void 			  onRequest(RequestFunction fn);
+	void 			  onMessageComplete(MessageCompleteFunction fn);
+	void 			  onPublish(PublishFunction fn);
+	void 			  onOtaFinished(OtaFinishedFunction fn);
 	
 	String 			  macToStr(const uint8_t* mac);
 	String 			  myAddress;
@@ -83,34 +347,55 @@ class SimpleEspNowConnection
   protected:    
 	typedef enum SimpleEspNowMessageType
 	{
-	  DATA = 1, PAIR = 2, CONNECT = 3
+	  DATA = 1, PAIR = 2, CONNECT = 3, RELAY = 4, REQUEST = 5, RESPONSE = 6, TIMESYNC = 7, SLOT = 8, SUBSCRIBE = 9, PUBLISH = 10, OTA = 11
 	} SimpleEspNowMessageType_t;
 	
 	class DeviceMessageBuffer
 	{
 		public:
+			// payload of a message queued for several devices, fragments point into it
+			typedef struct SharedPayload
+			{
+				uint8_t *data;
+				int refs;
+			} SharedPayload_t;
+			
 			class DeviceBufferObject
 			{
 				public:
 					DeviceBufferObject();
 					DeviceBufferObject(long id, int counter, int packages, const uint8_t *device);
-					DeviceBufferObject(long id, int counter, int packages, const uint8_t *device, const uint8_t* message, size_t len);
+					DeviceBufferObject(long id, int counter, int packages, const uint8_t *device, const uint8_t* message, size_t len, uint8_t type = SimpleEspNowMessageType::DATA);
+					DeviceBufferObject(long id, int counter, int packages, const uint8_t *device, SharedPayload_t *payload, size_t pos, size_t len, uint8_t type);
 					~DeviceBufferObject();
 
 					long _id;
 					uint8_t _device[6];
-					uint8_t _message[235];
+					uint8_t *_message;	// allocated with the size of the fragment
+					SharedPayload_t *_shared;	// _message points into a shared payload if set
 					size_t _len;
 					int _counter;
 					int _packages;
+					bool _raw;	// _message is a complete frame which is forwarded as it is
+					bool _held;	// queued, but not sent before releaseBuffer
+					bool _received;	// fragment has arrived (receive buffer only)
+					uint8_t _type;	// message type written into the header
+					uint32_t _seq;	// keeps the order of fragments to the same device
+					unsigned long _queuedAt;
 			};		
 
 			DeviceMessageBuffer();
 			~DeviceMessageBuffer();
 			
-			bool createBuffer(const uint8_t *device, const uint8_t* message, size_t len);
+			long createBuffer(const uint8_t *device, const uint8_t* message, size_t len, size_t fragmentSize = EspNowFragmentSize, uint8_t type = SimpleEspNowMessageType::DATA, bool held = false);
+			void releaseBuffer(const uint8_t *device, long id);
+			void discardBuffer(const uint8_t *device, long id);
 			bool createBuffer(const uint8_t *device, long id, int packages);
+			bool createRawBuffer(const uint8_t *device, const uint8_t* frame, size_t len);
+			int createSharedBuffer(const uint8_t (*devices)[6], int count, const uint8_t* message, size_t len, size_t fragmentSize, uint8_t type);
 			void addBuffer(const uint8_t *device, long id, uint8_t *buffer, size_t len, int package);
+			bool hasFragment(const uint8_t *device, long id, int package);
+			bool isComplete(const uint8_t *device, long id, int packages);
 			uint8_t* getBuffer(const uint8_t *device, long id, int packages, size_t len);
 			size_t getBufferSize(const uint8_t *device, long id, int packages);
 			SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject* getNextBuffer();
@@ -118,12 +403,90 @@ class SimpleEspNowConnection
 			bool deleteBuffer(SimpleEspNowConnection::DeviceMessageBuffer::DeviceBufferObject* dbo);
 			bool deleteBuffer(const uint8_t *device, long id);
 
+			int getQueuedCount(const uint8_t *device);
+			int getFreeCount();
+			
 			DeviceBufferObject *_dbo[MaxBufferSize]; // buffer for messages			
+			long _nextId;	// id of the next message created with createBuffer
+			int _queueLimit;	// maximum fragments queued for one device
+			
+		private:
+			// per device queue for deficit round robin scheduling of the send buffer
+			typedef struct DeviceQueue
+			{
+				uint8_t device[6];
+				bool used;
+				uint16_t count;
+				int32_t deficit;
+			} DeviceQueue_t;
+			
+			int findQueue(const uint8_t *device, bool create);
+			DeviceBufferObject* getQueueHead(const uint8_t *device);
+			bool linkFragments(const uint8_t *device, DeviceBufferObject **fragments, int packages, long *id = NULL, SharedPayload_t *payload = NULL);
+			void releasePayload(SharedPayload_t *payload);
+			
+			DeviceQueue_t _queues[MaxBufferSize];
+			int _cursor;
+			uint32_t _nextSeq;
+			
+			// any task can queue fragments while loop() sends and deletes them, objects
+			// are allocated and freed outside of the lock, it only covers the slots
+			EspNowLockType _lock = EspNowLockInitializer;
 	};
 	
 	DeviceMessageBuffer deviceSendMessageBuffer;
 	DeviceMessageBuffer deviceReceiveMessageBuffer;
 	
+	class PeerDatabase
+	{
+		public:
+			PeerDatabase();
+			
+			int findPeer(const uint8_t *mac);
+			int addPeer(const uint8_t *mac);
+			bool removePeer(const uint8_t *mac);
+			void touchPeer(int slot);
+			bool load(SimpleEspNowPeerStorage *storage);
+			bool flush(bool all = false);
+			void markDirty(int slot, bool urgent = true);
+			bool isFlushUrgent();
+			bool isDuplicate(int slot, long id);
+			void markReceived(int slot, long id);
+			void countDuplicate(int slot);
+			void addLatency(int slot, int32_t latency);
+			
+			typedef struct PeerState	// runtime state, not persisted
+			{
+				uint32_t lastId;		// highest message id received
+				uint32_t window;		// bit n set: message lastId-1-n received
+				uint32_t duplicates;
+				bool valid;
+				uint16_t txSlot;		// assigned transmit slot + 1, 0 if none
+				volatile bool slotPending;	// slot assignment has to be sent
+				uint8_t slotRetries;
+				uint8_t subscriptionQueries;	// 0xFF once the subscriptions of the peer are known
+				unsigned long lastSubscriptionQuery;
+				SimpleEspNowLatencyStatistics_t latency;
+				SimpleEspNowQueueStatistics_t queue;
+			} PeerState_t;
+			
+			SimpleEspNowPeer_t _peers[MaxPeerCount];
+			PeerState_t _state[MaxPeerCount];
+			int _count;
+			uint32_t _duplicates;	// duplicates of all peers
+			
+		private:
+			static uint32_t hashMac(const uint8_t *mac);
+			bool writeHeader();
+			
+			SimpleEspNowPeerStorage *_storage;
+			uint8_t _dirty[(MaxPeerCount+7)/8];
+			bool _urgent;
+			EspNowLockType _lock = EspNowLockInitializer;
+	};
+	
+	PeerDatabase peerDatabase;
+	
   private:    
 	SimpleEspNowRole_t    _role;
 	  
@@ -132,29 +495,235 @@ class SimpleEspNowConnection
 	uint8_t _serverMac[6];
 	uint8_t	_channel;	
 	volatile long	_lastSentTime;
+	unsigned long	_peerFlushInterval = 60000;
+	unsigned long	_lastPeerFlush;
 				   
 	bool initServer();
 	bool initClient();	
-	void prepareSendPackages(uint8_t* message, size_t len, String address);
-	bool sendPackage(long id, int package, int sum, uint8_t* message, size_t messagelen, uint8_t* address);
+	uint32_t prepareSendPackages(uint8_t* message, size_t len, const uint8_t* mac, uint8_t type = SimpleEspNowMessageType::DATA);
+	uint32_t queueMessage(uint8_t type, uint8_t* message, size_t len, const uint8_t* mac);
+	bool sendPackage(long id, int package, int sum, uint8_t* message, size_t messagelen, uint8_t* address, uint8_t type = SimpleEspNowMessageType::DATA);
+	bool sendRoutedFrame(const uint8_t* address, const uint8_t* frame, size_t len);
+	bool sendFrame(const uint8_t* address, const uint8_t* frame, size_t len);
+	void sendDone(const uint8_t* mac, uint8_t sendStatus);
+	bool queueFrame(const uint8_t* address, const uint8_t* frame, size_t len);
+	const uint8_t* getNextHop(const uint8_t* address, size_t len);
+	size_t buildRelayFrame(uint8_t* relayMessage, const uint8_t* address, const uint8_t* frame, size_t len);
+	void stampFrame(uint8_t* frame, size_t len);
+	size_t getFragmentSize(const uint8_t* mac);
+	void setPeerFrameSize(const uint8_t* mac, const uint8_t* advertised);
+	
+	int findRoute(const uint8_t* dest);
+	void learnRoute(const uint8_t* dest, const uint8_t* nextHop, uint8_t hops);
+	void removeRoute(const uint8_t* dest);
+	bool isRelayDuplicate(const uint8_t* origin, const uint8_t* inner);
+	void handleRelayFrame(const uint8_t *mac, const uint8_t *data, int len);
 	
 	uint8_t* strToMac(const char* str);	
 	
 #if defined(ESP8266)
 	static void onReceiveData(uint8_t *mac, uint8_t *data, uint8_t len);
+#elif defined(EspNowRecvInfo)
+	static void onReceiveData(const esp_now_recv_info_t *info, const uint8_t *data, int len);
 #elif defined(ESP32)
 	static void onReceiveData(const uint8_t *mac, const uint8_t *data, int len);
+#endif
+	static void processFrame(const uint8_t *mac, const uint8_t *data, int len);
+	void deliverMessage(uint8_t type, const uint8_t *mac, const uint8_t *message, size_t len);
+	void checkRequestTimeouts();
+	void handleTimeSync(const uint8_t *mac, const uint8_t *message, size_t len);
+	bool sendTimeSync(const uint8_t *mac, uint8_t mode, uint32_t t1, uint32_t t2);
+	bool sendSlotAssignment(int slot);
+	void sendSlotAssignments();
+	void handleSlotAssignment(const uint8_t *mac, const uint8_t *message, size_t len);
+	bool isInTransmitSlot();
+	bool trackMessage(long id, const uint8_t *mac, int packages, uint8_t type);
+	int findTracked(long id);
+	static bool isTrackedType(uint8_t type);
+	bool isMessageFailed(long id);
+	void completeFragment(long id, bool success);
+	void trace(uint8_t event, const uint8_t *mac, long id, uint8_t fragment = 0, uint8_t status = 0);
+	int findTopic(uint16_t topic, bool create);
+	void handleSubscribe(const uint8_t *mac, const uint8_t *message, size_t len);
+	void clearSubscriptions(int slot);
+	void querySubscriptions(int slot);
+	bool sendSubscriptions(uint8_t op, const uint16_t *topics, int count);
+	int findOtaSession(const uint8_t *mac);
+	void handleOta(const uint8_t *mac, const uint8_t *message, size_t len);
+	void processOtaSessions();
+	void processOtaTarget();
+	void freeOtaRing();
+	bool sendOtaControl(const uint8_t *mac, uint8_t op, uint32_t value, uint8_t status);
+	void finishOta(const uint8_t *mac, bool success);
+	bool transmitNext();
+	void notifyTransmit();
+#if defined(ESP32)
+	static void transmitTask(void *arg);
 #endif
 	static void pairingTickerServer();
 	static void pairingTickerClient();
 	static void pairingTickerLED();
+	static void pairingReplyClient();
+	void sendPairingBeacon();
 	
 	Ticker _pairingTicker, _pairingTickerBlink;	
 	volatile bool _pairingOngoing;
 	volatile int _pairingCounter;
-	volatile int _pairingMaxCount;
+	volatile unsigned long _pairingStartTime;
+	volatile unsigned long _pairingTimeout;
+	volatile unsigned long _nextBeaconTime;
+	uint32_t _pairingFastInterval = 250;	// beacon interval of the initial burst
+	int _pairingFastCount = 8;				// number of beacons in the initial burst
+	uint32_t _pairingMaxInterval = 5000;	// interval the backoff ends up with
+	uint32_t _pairingReplyJitter = 50;		// clients spread their pairing reply over this time
+	uint8_t _pairingReplyMac[6];
+	SimpleEspNowPairingStatistics_t _pairingStatistics;
 	bool _supportLooping;
 	volatile bool _openTransaction;
+	volatile bool _sending = false;		// a context is adding, sending to and deleting a peer
+
+	typedef struct RouteEntry
+	{
+		uint8_t dest[6];
+		uint8_t nextHop[6];
+		uint8_t hops;
+		bool used;
+		unsigned long lastUsed;
+	} RouteEntry_t;
+	
+	typedef struct RelayHistoryEntry
+	{
+		uint8_t origin[6];
+		uint8_t package;
+		long id;
+	} RelayHistoryEntry_t;
+	
+	typedef struct PendingRequest
+	{
+		bool used;
+		uint8_t generation;		// high byte of the request id, detects late responses
+		uint8_t peer[6];
+		unsigned long deadline;
+		ResponseFunction callback;
+	} PendingRequest_t;
+	
+	PendingRequest_t _requests[MaxPendingRequests];
+	
+	typedef struct TrackedMessage
+	{
+		uint8_t device[6];
+		unsigned long queuedAt;
+		uint8_t type;
+		SimpleEspNowMessageStatus_t status;
+	} TrackedMessage_t;
+	
+	// taken round robin by new messages, skipping pending ones, so the oldest
+	// finished status is overwritten
+	TrackedMessage_t _tracked[MaxTrackedMessages];
+	int _trackedNext = 0;
+	volatile long _inFlightId = 0;		// tracked message of the fragment waiting for the send callback
+	
+	// message tracking, the trace and the OTA receive ring are written by the
+	// callbacks and by the application tasks
+	EspNowLockType _lock = EspNowLockInitializer;
+	
+	typedef struct TopicEntry
+	{
+		uint16_t topic;
+		bool used;
+		uint8_t peers[(MaxPeerCount+7)/8];	// bit n set: peer database slot n subscribed
+	} TopicEntry_t;
+	
+	TopicEntry_t _topics[MaxTopicCount];			// server
+	uint16_t _subscriptions[MaxSubscriptions];	// client, sent again after CONNECT
+	int _subscriptionCount = 0;
+	
+	typedef struct OtaSession	// server side of a firmware transfer
+	{
+		bool used;
+		bool begun;				// client accepted the image
+		uint8_t peer[6];
+		uint8_t md5[16];
+		uint32_t size;
+		uint16_t blockSize;
+		uint32_t blocks;
+		uint32_t base;			// first block not acknowledged
+		uint32_t next;			// next block to send
+		unsigned long lastAck;
+		unsigned long lastProgress;	// base moved on
+		unsigned long ackTime;	// ms between two acknowledgements which moved base, averaged
+		bool resent;			// blocks were sent again since base moved
+		uint8_t retries;
+		uint32_t ackNext;		// latest acknowledgement, the receive callback hands it to loop()
+		bool ackMissing;		// it asks for the blocks from ackNext again
+		volatile bool ackPending;
+		volatile bool finished;	// result or abort received, loop() ends the session
+		bool success;
+		OtaReadFunction read;
+	} OtaSession_t;
+	
+	OtaSession_t _otaSessions[MaxOtaSessions];
+	
+	// client side, blocks are copied into a window by the receive callback
+	// and written to the target from loop()
+	SimpleEspNowOtaTarget *_otaTarget = NULL;
+	volatile bool _otaActive = false;
+	volatile bool _otaBeginPending = false;
+	uint8_t _otaBeginMessage[23];		// size, block size and md5 of the pending BEGIN
+	volatile bool _otaAbortPending = false;
+	volatile bool _otaGap = false;
+	volatile uint8_t _otaGapBlocks = 0;	// blocks received behind the gap since it was reported
+	volatile bool _otaAckDue = false;	// a block arrived again, the acknowledgement got lost
+	volatile bool _otaResultDue = false;	// blocks arrived after the end, the result got lost
+	bool _otaDone = false;
+	bool _otaResult = false;
+	uint8_t _otaMd5[16];
+	uint32_t _otaSize = 0;
+	uint16_t _otaBlockSize = 0;
+	uint32_t _otaBlocks = 0;
+	volatile uint32_t _otaNext = 0;		// next block to write
+	uint32_t _otaAckedNext = 0;
+	uint32_t _otaNackedNext = 0xFFFFFFFF;
+	uint8_t *_otaRing = NULL;
+	volatile uint32_t _otaRingBlock[OtaWindowSize];
+	uint16_t _otaRingLen[OtaWindowSize];
+	
+	SimpleEspNowTraceRecord_t _trace[TraceBufferSize];
+	volatile uint32_t _tracePos = 0;	// records written so far
+	
+	bool _sendTimestamps = false;
+	bool _timeSynced = false;
+	int32_t _clockOffset = 0;			// server time - local time in ms
+	float _clockSkew = 0;				// drift of the server clock in ppm
+	unsigned long _lastTimeSync = 0;	// local time of the last accepted sample
+	unsigned long _timeSyncInterval = 0;
+	unsigned long _lastTimeSyncRequest = 0;
+	uint32_t _roundTripTime = 0;
+	
+	uint16_t _slotFrame = 0;			// length of one TDMA frame in ms, 0 if not slotted
+	uint16_t _slotLength = 0;
+	uint16_t _slotCount = 0;
+	uint16_t _nextTxSlot = 0;			// server: next slot to hand out
+	int _txSlot = -1;					// client: own slot
+	bool _slotWaiting = false;
+	SimpleEspNowSendStatistics_t _sendStatistics;
+	
+	// fragments are sent by a task (ESP32) or a scheduled function (ESP8266)
+	// instead of loop()
+	volatile bool _transmitEngine = false;
+#if defined(ESP32)
+	TaskHandle_t _transmitTask = NULL;
+#elif defined(ESP8266)
+	bool _transmitScheduled = false;
+#endif
+	
+	RouteEntry_t _routes[MaxRouteCount];
+	RelayHistoryEntry_t _relayHistory[RelayHistorySize];
+	int _relayHistoryPos = 0;
+	bool _relayMode = false;
+	uint8_t _relayHopLimit = MaxRelayHops;
+	uint8_t _relayMac[6];
+	bool _relayMacSet = false;
 
 	int _pairingGPIO = -1;	
 	int _pairingInvers = true;	
@@ -166,6 +735,10 @@ class SimpleEspNowConnection
 	SendErrorFunction				_SendErrorFunction = NULL;
 	SendDoneFunction				_SendDoneFunction = NULL;
 	PairingFinishedFunction			_PairingFinishedFunction = NULL;	
+	RequestFunction					_RequestFunction = NULL;
+	MessageCompleteFunction			_MessageCompleteFunction = NULL;
+	PublishFunction					_PublishFunction = NULL;
+	OtaFinishedFunction				_OtaFinishedFunction = NULL;
 	
 #if defined(ESP32)
 	esp_now_peer_info_t _serverMacPeerInfo;
@@ -0,0 +1,102 @@
+/*
+  SimpleEspNowLittleFSStorage.h - LittleFS storage backend for the peer database
+  of SimpleEspNowConnection. Include this file in your sketch and pass an instance
+  to SimpleEspNowConnection::setPeerStorage().
+*/
+
+#ifndef SIMPLEESPNOWLITTLEFSSTORAGE_H
+#define SIMPLEESPNOWLITTLEFSSTORAGE_H
+
+#include "SimpleEspNowConnection.h"
+#include <LittleFS.h>
+
+class SimpleEspNowLittleFSStorage : public SimpleEspNowPeerStorage
+{
+  public:
+	SimpleEspNowLittleFSStorage(const char* path = "/espnow_peers.bin")
+	{
+		_path = path;
+	}
+	
+	~SimpleEspNowLittleFSStorage()
+	{
+		commit();
+	}
+	
+	bool begin(size_t size)
+	{
+#if defined(ESP32)
+		if(!LittleFS.begin(true)) // format an unformatted partition
+#else
+		if(!LittleFS.begin())
+#endif
+			return false;
+		
+		if(LittleFS.exists(_path))
+		{
+			File f = LittleFS.open(_path, "r");
+			bool sizeOk = f && f.size() == size;
+			
+			f.close();
+			
+			if(sizeOk)
+				return true;
+		}
+		
+		// create a zero filled file, records are updated in place afterwards
+		File f = LittleFS.open(_path, "w");
+		
+		if(!f)
+			return false;
+		
+		uint8_t zero[32];
+		memset(zero, 0, sizeof(zero));
+		
+		for(size_t pos = 0; pos < size; pos += sizeof(zero))
+			f.write(zero, size - pos > sizeof(zero) ? sizeof(zero) : size - pos);
+		
+		f.close();
+		
+		return true;
+	}
+	
+	bool read(size_t offset, uint8_t* data, size_t len)
+	{
+		File f = LittleFS.open(_path, "r");
+		
+		if(!f || !f.seek(offset))
+			return false;
+		
+		bool ret = f.read(data, len) == len;
+		
+		f.close();
+		
+		return ret;
+	}
+	
+	bool write(size_t offset, const uint8_t* data, size_t len)
+	{
+		// keep the file open for all records of one flush
+		if(!_file)
+			_file = LittleFS.open(_path, "r+");
+		
+		if(!_file || !_file.seek(offset))
+			return false;
+		
+		return _file.write(data, len) == len;
+	}
+	
+	bool commit()
+	{
+		if(_file)
+			_file.close();
+		
+		return true;
+	}
+	
+  private:
+	const char* _path;
+	File _file;
+};
+
+#endif
@@ -0,0 +1,58 @@
+/*
+  SimpleEspNowUpdateTarget.h - Writes a firmware image received with
+  SimpleEspNowConnection into the OTA partition using the Update library.
+  Include this file in your sketch and pass an instance to
+  SimpleEspNowConnection::setOtaTarget(). Restart the device in the
+  onOtaFinished callback to boot the new image.
+*/
+
+#ifndef SIMPLEESPNOWUPDATETARGET_H
+#define SIMPLEESPNOWUPDATETARGET_H
+
+#include "SimpleEspNowConnection.h"
+
+#if defined(ESP8266)
+#include <Updater.h>
+#elif defined(ESP32)
+#include <Update.h>
+#endif
+
+class SimpleEspNowUpdateTarget : public SimpleEspNowOtaTarget
+{
+  public:
+	bool begin(uint32_t size, const uint8_t* md5)
+	{
+		char hex[33];
+
+		for(int i = 0; i<16; i++)
+			sprintf(hex+2*i, "%02x", md5[i]);
+
+		if(!Update.begin(size))
+			return false;
+
+		// end() fails if the written image does not match
+		return Update.setMD5(hex);
+	}
+
+	bool write(uint32_t offset, const uint8_t* data, size_t len)
+	{
+		// blocks arrive in order, the offset is implicit for Update
+		return Update.write((uint8_t *)data, len) == len;
+	}
+
+	bool end()
+	{
+		return Update.end();
+	}
+
+	void abort()
+	{
+#if defined(ESP32)
+		Update.abort();
+#else
+		Update.end();	// the image is incomplete, so it is discarded
+#endif
+	}
+};
+
+#endif